@@ -0,0 +1,159 @@
+// Sudoku-specialised search on candidate bitmasks: bit d of a mask stands for the number d + 1.
+// It keeps one mask of the numbers already used per row, column and box, so placing or removing
+// a number is three XORs and the candidates of a cell are what none of its units uses.
+// Like the column choice of exact_cover, it branches on the cell with the fewest candidates unless
+// a number has a single place left in a row, column or box. Boards up to 64 x 64 fit in the masks
+// (mask_t, see setup.h).
+
+// Solve a board starting from the valid_candidates of initial_check, writing the first completed
+// grid in solution (the same grid convert_answer_board builds from an exact cover answer).
+// Stops after limit solutions (0: all of them) and returns the number found.
+unsigned int bitboard_cover(const int *board, int n, const unsigned char *valid_candidates, int *solution,
+                           unsigned int limit) {
+    int N = n * n, i, j, d, k;
+    if (N > 64) {
+        fprintf(stderr, "The bitboard engine supports boards up to 64 x 64, not %d x %d.\n", N, N);
+        return 0;
+    }
+
+    mask_t *rows_used = calloc(N, sizeof(mask_t));
+    mask_t *cols_used = calloc(N, sizeof(mask_t));
+    mask_t *boxes_used = calloc(N, sizeof(mask_t));
+    mask_t *allowed = malloc(N * N * sizeof(mask_t));
+    int *cells = malloc(N * N * sizeof(int));   // empty cells, the first depth ones are filled
+    int *where = malloc(N * N * sizeof(int));   // position of each empty cell in cells
+    mask_t *tried = malloc(N * N * sizeof(mask_t)); // numbers left to try at each depth
+    mask_t *once = malloc(3 * N * sizeof(mask_t));  // per unit: numbers with at least one place
+    mask_t *twice = malloc(3 * N * sizeof(mask_t)); // per unit: numbers with at least two places
+    int *grid = malloc(N * N * sizeof(int));        // the board being filled
+    int empty = 0;
+
+    for (i = 0; i < N * N; ++i) {
+        grid[i] = board[i];
+        if (board[i] != 0) {
+            mask_t bit = (mask_t) 1 << (board[i] - 1);
+            rows_used[ROW(i, N)] |= bit;
+            cols_used[COL(i, N)] |= bit;
+            boxes_used[BOX(i, n)] |= bit;
+            continue;
+        }
+        allowed[i] = 0;
+        for (d = 0; d < N; ++d)
+            if (valid_candidates[i * N + d])
+                allowed[i] |= (mask_t) 1 << d;
+        where[i] = empty;
+        cells[empty++] = i;
+    }
+    mask_t all_numbers = N == 64 ? ~(mask_t) 0 : ((mask_t) 1 << N) - 1;
+
+#define CANDIDATES(p) (allowed[p] & ~(rows_used[ROW(p, N)] | cols_used[COL(p, N)] | boxes_used[BOX(p, n)]))
+#define TOGGLE(p, bit) { \
+    rows_used[ROW(p, N)] ^= (bit); \
+    cols_used[COL(p, N)] ^= (bit); \
+    boxes_used[BOX(p, n)] ^= (bit); \
+}
+
+    int depth = 0;
+    unsigned int found = 0;
+    int choose = 1; // 1 - pick the next cell, 0 - try the next number of cells[depth]
+    while (1) {
+        if (choose && depth == empty) {
+            if (found++ == 0)
+                memcpy(solution, grid, N * N * sizeof(int));
+            if (found == limit || depth == 0)
+                break;
+            // keep searching from the last cell
+            --depth;
+            choose = 0;
+        }
+
+        if (choose) {
+
+            // pick the empty cell with the fewest candidates, gathering which numbers
+            // can go once or more in every unit (rows, then columns, then boxes) on the way
+            int best = depth, best_count = N + 1;
+            for (k = 0; k < 3 * N; ++k)
+                once[k] = twice[k] = 0;
+            for (i = depth; i < empty && best_count > 1; ++i) {
+                int p = cells[i];
+                mask_t candidates = CANDIDATES(p);
+                int count = mask_popcount(candidates);
+                if (count < best_count) {
+                    best = i;
+                    best_count = count;
+                }
+                int units[3] = {ROW(p, N), N + COL(p, N), 2 * N + BOX(p, n)};
+                for (k = 0; k < 3; ++k) {
+                    twice[units[k]] |= once[units[k]] & candidates;
+                    once[units[k]] |= candidates;
+                }
+            }
+            mask_t only = ~(mask_t) 0;
+
+            // a number with no place left in a unit is a dead end, one with a single place is forced
+            for (k = 0; k < 3 * N && best_count > 1; ++k) {
+                int kind = k / N, u = k % N;
+                mask_t used = kind == 0 ? rows_used[u] : kind == 1 ? cols_used[u] : boxes_used[u];
+
+                if (all_numbers & ~(used | once[k])) {
+                    best_count = 0;
+                    only = 0;
+                } else if (once[k] & ~twice[k]) {
+                    d = mask_lowest(once[k] & ~twice[k]);
+                    for (j = 0; j < N; ++j) {
+                        int p = UNIT_CELL(kind, u, j, n);
+                        if (grid[p] == 0 && (CANDIDATES(p) >> d & 1))
+                            break;
+                    }
+                    best = where[UNIT_CELL(kind, u, j, n)];
+                    best_count = 1;
+                    only = (mask_t) 1 << d;
+                }
+            }
+
+            int swap = cells[depth];
+            cells[depth] = cells[best];
+            cells[best] = swap;
+            where[cells[depth]] = depth;
+            where[cells[best]] = best;
+            tried[depth] = CANDIDATES(cells[depth]) & only;
+        } else {
+            // take back the number placed at this depth
+            int p = cells[depth];
+            TOGGLE(p, (mask_t) 1 << (grid[p] - 1))
+            grid[p] = 0;
+        }
+
+        if (tried[depth] == 0) {
+            // no number left for this cell
+            if (depth == 0)
+                break;
+            --depth;
+            choose = 0;
+            continue;
+        }
+
+        int p = cells[depth];
+        d = mask_lowest(tried[depth]);
+        tried[depth] &= tried[depth] - 1;
+        grid[p] = d + 1;
+        TOGGLE(p, (mask_t) 1 << d)
+        ++depth;
+        choose = 1;
+    }
+
+#undef CANDIDATES
+#undef TOGGLE
+
+    free(rows_used);
+    free(cols_used);
+    free(boxes_used);
+    free(allowed);
+    free(cells);
+    free(where);
+    free(tried);
+    free(once);
+    free(twice);
+    free(grid);
+    return found;
+}
@@ -1,23 +1,341 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #define CL_TARGET_OPENCL_VERSION 120
 
 #include "ocl_boiler.h"
 #include "setup.h"
+#include "tasks.h"
 
 cl_event
-execute_exact_cover_kernel(cl_command_queue q, cl_kernel k, size_t task_count, size_t lws, cl_int n, cl_mem d_tasks,
-                           cl_mem d_dlx, cl_mem d_dlxs, cl_mem d_dlx_props, cl_int dlx_size, cl_mem d_ans,
-                           cl_mem d_ans_found, cl_event *waitingList, int waitingListSize);
+execute_exact_cover_kernel(cl_command_queue q, cl_kernel k, size_t task_count, size_t first_task,
+                           size_t launch_tasks, size_t lws, cl_int n, cl_mem d_tasks,
+                           cl_mem d_dlx, cl_mem d_dlxs, size_t local_copy_bytes, cl_mem d_dlx_props,
+                           cl_int dlx_size, cl_mem d_ans, cl_mem d_ans_found, cl_int task_depth, cl_uint limit,
+                           cl_int cover_words, cl_mem d_queue, cl_mem d_loads, size_t groups, cl_mem d_stats,
+                           cl_event *waitingList, int waitingListSize);
 
-int permutate_tasks(const int *dlx, int dlx_size, int *tasks, int i);
+cl_event
+execute_exact_cover_multi_kernel(cl_command_queue q, cl_kernel k, size_t task_count, size_t lws, cl_int N,
+                                 cl_mem d_tasks, cl_mem d_task_puzzle, cl_mem d_puzzles, cl_mem d_scratch_offsets,
+                                 cl_mem d_dlx, cl_mem d_dlxs, size_t local_copy_bytes, cl_int copy_stride,
+                                 cl_mem d_dlx_props, cl_mem d_ans, cl_mem d_ans_data, cl_int task_depth,
+                                 cl_uint limit, cl_int cover_words, cl_mem d_stats,
+                                 cl_event *waitingList, int waitingListSize);
+
+// --lean: search the shared dancing links with a bitset of covered columns instead of copying them per task
+int lean = 0;
+
+// --split-depth / --split-tasks: expand the tasks breadth-first down to this many levels / until
+// there are this many of them, instead of one task per row of every column (both 0)
+int split_depth = 0;
+int split_tasks = 0;
+
+// --persistent: launch one work-group per compute unit pulling tasks from a global queue
+int persistent = 0;
+
+// --instrument: build the kernels with DLX_INSTRUMENT and report the per-task counters
+int instrument = 0;
+
+// --template: start every puzzle from the dancing links of the empty board of its size (see DlxTemplate),
+// instead of propagating and building its own
+int use_template = 0;
+struct DlxTemplate dlx_template = {0};
+
+// --global-dlx: keep the dlx copies of the work-items in global memory even when they fit in local memory
+int global_dlx = 0;
+
+// Device buffers kept across the puzzles of a batch, grown when a bigger puzzle comes in
+struct Buffers {
+    cl_mem tasks, dlx, dlx_props, answer_data, answer, dlxs;
+    size_t tasks_bytes, dlx_bytes, dlx_props_bytes, answer_data_bytes, answer_bytes, dlxs_bytes;
+    // offset tables of the multi-puzzle kernel
+    cl_mem task_puzzle, puzzles, scratch_offsets;
+    size_t task_puzzle_bytes, puzzles_bytes, scratch_offsets_bytes;
+    // task queue counter and per work-item loads of the persistent kernels
+    cl_mem queue, loads;
+    size_t queue_bytes, loads_bytes;
+    // per-task counters of the instrumented kernels
+    cl_mem stats;
+    size_t stats_bytes;
+};
+
+// A board turned into its dancing links and top-level tasks, ready to be uploaded
+struct Puzzle {
+    int N;
+    int dlx_size;
+    int *dlx; // DLX_PLANES planes followed by the col/row props, in the arena of prepare_puzzle
+    int *tasks; // task_count prefixes of task_depth rows
+    int task_count;
+    int task_depth;
+    int *convert_table; // in the arena of prepare_puzzle
+    int *board; // after propagation
+};
+
+// results of prepare_puzzle
+#define PREPARE_SEARCH 0  // tasks ready to be searched
+#define PREPARE_SOLVED 1  // filled by propagation alone, board holds the solution
+#define PREPARE_FAILED -1 // no solution, or nothing to search
+
+// same layout as the PUZZLE_* fields of dlx_kernels.cl
+#define PUZZLE_NODE_OFFSET 0
+#define PUZZLE_DLX_SIZE 1
+#define PUZZLE_TASK_OFFSET 2
+#define PUZZLE_FIELDS 3
+
+// same layout as the ANSWER_* fields of dlx_kernels.cl
+#define ANSWER_FOUND 0
+#define ANSWER_LENGTH 1
+#define ANSWER_SOLUTIONS 2
+#define ANSWER_COUNTED 3
+#define ANSWER_FIELDS 4
+
+// A puzzle launched by launch_puzzle, until finish_puzzle reads its answer back. It holds the host
+// data the non-blocking writes read from, and the events of the launch.
+struct Flight {
+    struct Task task;
+    struct Puzzle puzzle;
+    struct Buffers *buffers;
+    cl_command_queue queue;
+    int *solution;
+    int searching; // a kernel was enqueued, the board was settled by prepare_puzzle otherwise
+    int answer_data[ANSWER_FIELDS];
+    int queue_start;
+    cl_ushort *links16;
+    int copies; // dlx copies, one per task (of a chunk) or per work-item of the persistent grid
+    cl_event evt_writes[5];
+    int write_count;
+    cl_event kernel_evt; // the last launch
+    cl_event *chunk_evts; // the launches before it, when the tasks are split in chunks
+    int chunk_count;
+};
+
+// tasks expanded for --count / --limit / --unique without a --split-* option, the default ones overlap
+#define COUNT_SPLIT_TASKS 1024
+
+// boards of at most this many nodes have every link and size in 16 bits, and are searched by the
+// DLX_LINK16 kernels on dlx planes of cl_ushort (up to 25 x 25 boards always fit)
+#define LINK16_MAX_NODES 65536
+
+// same layout as the STAT_* fields of dlx_kernels.cl
+#define STAT_PUSHES 0
+#define STAT_POPS 1
+#define STAT_REMOVES 2
+#define STAT_RESTORES 3
+#define STAT_NODES 4
+#define STAT_FIELDS 5
+
+// --instrument: counters of every task launched, summed over the puzzles of a run
+#define STAT_BUCKETS 32
+struct TaskStats {
+    int tasks;
+    int idle; // never searched, the board was solved (or the queue emptied) first
+    double totals[STAT_FIELDS];
+    cl_uint max_nodes;
+    int buckets[STAT_BUCKETS]; // searched tasks by the highest bit of their nodes touched
+} task_stats;
+
+int prepare_puzzle(const int *board, int n, struct Puzzle *puzzle, struct Arena *arena);
+
+void free_puzzle(struct Puzzle puzzle);
+
+void freeBuffers(struct Buffers buffers);
+
+struct Task solve(const int *board, int n, int lws, struct Info *info, struct Buffers *buffers, int *solution);
+
+void launch_puzzle(struct Flight *flight, const int *board, int n, int lws, struct Info *info,
+                   cl_command_queue queue, struct Buffers *buffers, struct Arena *arena, int *solution);
+
+struct Task finish_puzzle(struct Flight *flight);
+
+int solve_batch(const char *file_name, int lws, const char *csv);
+
+int solve_multi(const char *file_name, int lws, int boards_per_launch, const char *csv);
+
+int solve_group(struct Puzzle *puzzles, const int *prepared, int count, int lws,
+                struct Info *info, struct Buffers *buffers, FILE *csv_file, int *skipped);
+
+void print_task_stats();
+
+// kernel searching the tasks of one puzzle, for the --lean and --persistent options
+const char *single_kernel_name() {
+    if (persistent)
+        return lean ? "exact_cover_lean_persistent_kernel" : "exact_cover_persistent_kernel";
+    return lean ? "exact_cover_lean_kernel" : "exact_cover_kernel";
+}
+
+// The kernels built so far, one per kernel name and build options. In a batch the place of the dlx
+// copies (-DDLX_LOCAL) is decided per puzzle and may flip between puzzles of the same size, so every
+// variant stays built instead of being reloaded, possibly while the other queue still uses the last one.
+#define MAX_KERNEL_VARIANTS 16
+
+struct KernelVariant {
+    const char *kernel_name;
+    char options[128];
+    cl_program program;
+    cl_kernel kernel;
+    size_t preferred_multiple;
+};
+
+struct KernelVariant kernel_variants[MAX_KERNEL_VARIANTS];
+int kernel_variant_count = 0;
+
+// Make info use kernel_name specialized on N x N boards (-DDLX_N), 16-bit links (-DDLX_LINK16) and dlx
+// copies in local memory (-DDLX_LOCAL), building it the first time it is asked for. A batch mixing
+// sizes switches between the variants, each compiled once and then loaded from the program cache.
+void specialize_kernel(struct Info *info, const char *kernel_name, int N, int link16, int local_dlx) {
+    char options[128];
+    snprintf(options, sizeof(options), "-I. -DDLX_N=%d%s%s%s%s", N, DLX_LAYOUT_OPTION,
+             link16 ? " -DDLX_LINK16" : "", local_dlx ? " -DDLX_LOCAL" : "",
+             instrument ? " -DDLX_INSTRUMENT" : "");
+
+    struct KernelVariant *variant = NULL;
+    for (int i = 0; i < kernel_variant_count && variant == NULL; ++i)
+        if (strcmp(kernel_variants[i].kernel_name, kernel_name) == 0
+            && strcmp(kernel_variants[i].options, options) == 0)
+            variant = &kernel_variants[i];
+
+    if (variant == NULL) {
+        // the table only fills up with many board sizes: the oldest variant makes room, the queues
+        // keep their own references to it until its launches complete
+        if (kernel_variant_count == MAX_KERNEL_VARIANTS) {
+            clReleaseKernel(kernel_variants[0].kernel);
+            clReleaseProgram(kernel_variants[0].program);
+            memmove(kernel_variants, kernel_variants + 1, (MAX_KERNEL_VARIANTS - 1) * sizeof(struct KernelVariant));
+            --kernel_variant_count;
+        }
+
+        // load_kernel releases the kernel of info, which belongs to the table
+        info->kernel = NULL;
+        info->program = NULL;
+        double start_time = wall_time_us();
+        load_kernel(info, "dlx_kernels.cl", kernel_name, options);
+        timings.setup += wall_time_us() - start_time;
+
+        variant = &kernel_variants[kernel_variant_count++];
+        variant->kernel_name = kernel_name;
+        strcpy(variant->options, options);
+        variant->program = info->program;
+        variant->kernel = info->kernel;
+        variant->preferred_multiple = info->preferred_multiple_init;
+    }
+
+    info->program = variant->program;
+    info->kernel = variant->kernel;
+    info->preferred_multiple_init = variant->preferred_multiple;
+}
+
+// Release every variant built by specialize_kernel, before freeInfo(info)
+void release_kernel_variants(struct Info *info) {
+    for (int i = 0; i < kernel_variant_count; ++i) {
+        clReleaseKernel(kernel_variants[i].kernel);
+        clReleaseProgram(kernel_variants[i].program);
+    }
+    kernel_variant_count = 0;
+    info->kernel = NULL;
+    info->program = NULL;
+}
+
+// Whether lws dlx copies of copy_bytes each fit in the local memory of the device next to the
+// stacks of the work-items (N * N ints each), so that the kernels can search them there
+int local_dlx_fits(struct Info *info, size_t copy_bytes, int N, int lws) {
+    if (lean || global_dlx)
+        return 0;
+
+    cl_ulong local_mem_size;
+    cl_int err = clGetDeviceInfo(info->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem_size),
+                                 &local_mem_size, NULL);
+    ocl_check(err, "get local memory size");
+    return (copy_bytes + N * N * sizeof(int)) * lws <= local_mem_size;
+}
+
+// CL_DEVICE_MAX_MEM_ALLOC_SIZE: the biggest buffer the device can allocate
+cl_ulong max_alloc_size(struct Info *info) {
+    cl_ulong max_alloc;
+    cl_int err = clGetDeviceInfo(info->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+    ocl_check(err, "get max allocation size");
+    return max_alloc;
+}
 
-struct Task solve(const int *board, int n, int lws);
+// The largest tile up to lws whose work-items all get item_bytes of local memory (their stack, and the
+// cover bitset of --lean), 0 when a single one does not fit. Big boards need smaller tiles.
+int fit_local_tile(struct Info *info, size_t item_bytes, int lws) {
+    cl_ulong local_mem_size;
+    cl_int err = clGetDeviceInfo(info->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem_size),
+                                 &local_mem_size, NULL);
+    ocl_check(err, "get local memory size");
+    if (item_bytes * lws <= local_mem_size)
+        return lws;
+    int tile = (int) (local_mem_size / item_bytes);
+    if (tile > 0)
+        LOG("Tile reduced from %d to %d work-items: %zu bytes of local memory each\n", lws, tile, item_bytes);
+    return tile;
+}
+
+// Whether a buffer of bytes can be allocated on a device with max_alloc, saying which one cannot
+int fits_device(size_t bytes, cl_ulong max_alloc, const char *name) {
+    if (bytes <= max_alloc)
+        return 1;
+    fprintf(stderr, "Device buffer %s would take %zu bytes, more than the %llu the device allows\n", name, bytes,
+            (unsigned long long) max_alloc);
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
+    // options before the mode
+    while (argc > 1) {
+        int shift = 1;
+        if (strcmp(argv[1], "--lean") == 0) {
+            lean = 1;
+        } else if (strcmp(argv[1], "--persistent") == 0) {
+            persistent = 1;
+        } else if (strcmp(argv[1], "--count") == 0) {
+            solution_limit = 0;
+        } else if (strcmp(argv[1], "--unique") == 0) {
+            solution_limit = 2;
+        } else if (strcmp(argv[1], "--timings") == 0) {
+            report_timings = 1;
+        } else if (strcmp(argv[1], "--instrument") == 0) {
+            instrument = 1;
+        } else if (strcmp(argv[1], "--global-dlx") == 0) {
+            global_dlx = 1;
+        } else if (strcmp(argv[1], "--template") == 0) {
+            use_template = 1;
+        } else if (argc > 2 && strcmp(argv[1], "--limit") == 0) {
+            solution_limit = (unsigned int) strtoul(argv[2], NULL, 10);
+            shift = 2;
+        } else if (argc > 2 && strcmp(argv[1], "--split-depth") == 0) {
+            split_depth = atoi(argv[2]);
+            shift = 2;
+        } else if (argc > 2 && strcmp(argv[1], "--split-tasks") == 0) {
+            split_tasks = atoi(argv[2]);
+            shift = 2;
+        } else {
+            break;
+        }
+        argv[shift] = argv[0];
+        argv += shift;
+        argc -= shift;
+    }
+
+    if (argc >= 4 && argc <= 5 && strcmp(argv[1], "--batch") == 0)
+        return solve_batch(argv[2], atoi(argv[3]), argc == 5 ? argv[4] : "");
+    if (argc >= 5 && argc <= 6 && strcmp(argv[1], "--multi") == 0) {
+        if (persistent) {
+            fprintf(stderr, "--persistent is not available with --multi\n");
+            return 1;
+        }
+        return solve_multi(argv[2], atoi(argv[3]), atoi(argv[4]), argc == 6 ? argv[5] : "");
+    }
+
     if (argc < 3 || argc > 4) {
-        fprintf(stderr, "Usage: %s <sudoku> <tile_size> [csv]\n", argv[0]);
+        fprintf(stderr, "Usage: %s [options] <sudoku> <tile_size> [csv]\n", argv[0]);
+        fprintf(stderr, "       %s [options] --batch <puzzles|-> <tile_size> [csv]\n", argv[0]);
+        fprintf(stderr, "       %s [options] --multi <puzzles|-> <tile_size> <boards_per_launch> [csv]\n", argv[0]);
+        fprintf(stderr, "Options: --lean, --persistent, --split-depth <levels>, --split-tasks <count>,\n");
+        fprintf(stderr, "         --count, --limit <solutions>, --unique, --timings, --instrument, --global-dlx,\n");
+        fprintf(stderr, "         --template\n");
         return 1;
     }
 
@@ -31,7 +349,15 @@ int main(int argc, char *argv[]) {
     printf("Sudoku loaded: %d x %d\n", N, N);
     print_board(board, N);
 
-    struct Task task = solve(board, n, lws);
+    double start_time = wall_time_us();
+    struct Info info = initialize(NULL, NULL, NULL);
+    struct Buffers buffers = {0};
+    int *solution = calloc(N * N, sizeof(int));
+    timings.setup += wall_time_us() - start_time;
+
+    struct Task task = solve(board, n, lws, &info, &buffers, solution);
+    print_timings();
+    print_task_stats();
 
     if (*csv != 0) {
         FILE *csv_file = fopen(csv, "a");
@@ -39,218 +365,746 @@ int main(int argc, char *argv[]) {
         fclose(csv_file);
     }
 
+    freeBuffers(buffers);
+    free_template(&dlx_template);
+    release_kernel_variants(&info);
+    freeInfo(info);
+    free(solution);
     free(board);
     return 0;
 }
 
-struct Task solve(const int *board, int n, int lws) {
-    struct Task task = {0};
+// Solve every puzzle of a stream with one OpenCL context and program, printing one solution line
+// per puzzle. Two puzzles are in flight, each with its own queue and buffers: the next puzzle is
+// read, prepared and uploaded while the device still searches the previous one, whose answer is
+// only read back afterwards.
+int solve_batch(const char *file_name, int lws, const char *csv) {
+    struct BoardStream stream;
+    if (!open_board_stream(file_name, &stream))
+        return 1;
+    FILE *csv_file = *csv != 0 ? fopen(csv, "a") : NULL;
+    verbose = 0;
+
+    double start_time = wall_time_us();
+    struct Info info = initialize(NULL, NULL, NULL);
+    cl_command_queue queues[2] = {info.queue, create_queue(info.context, info.device)};
+    struct Buffers buffers[2] = {{0}};
+    struct Arena arenas[2] = {{0}};
+    struct Flight flights[2];
+    double setup_elapsed = (wall_time_us() - start_time) / 1000000;
+    timings.setup += setup_elapsed * 1000000;
+
+    int n, count = 0, solved = 0, skipped = 0, launched = 0;
+    double imbalance = 0;
+    int slot = 0, in_flight = 0; // in_flight: flights[1 - slot] holds the previous puzzle
+    while (1) {
+        int *board = next_board(&stream, &n);
+        int more = board != NULL;
+        if (more) {
+            int *solution = calloc(n * n * n * n, sizeof(int));
+            launch_puzzle(&flights[slot], board, n, lws, &info, queues[slot], &buffers[slot], &arenas[slot],
+                          solution);
+        }
+
+        if (in_flight) {
+            struct Flight *previous = &flights[1 - slot];
+            struct Task task = finish_puzzle(previous);
+            if (task.skipped) {
+                printf("skipped\n");
+                ++skipped;
+            } else {
+                print_result_line(previous->solution, task.size, task.solutions);
+            }
+            if (task.found)
+                ++solved;
+            if (csv_file != NULL)
+                write_task_to_csv(csv_file, task);
+            if (task.load_imbalance > 0) {
+                imbalance += task.load_imbalance;
+                ++launched;
+            }
+            ++count;
+            free(previous->solution);
+        }
+
+        if (!more)
+            break;
+        in_flight = 1;
+        slot = 1 - slot;
+    }
+    double elapsed = (wall_time_us() - start_time) / 1000000;
+
+    fprintf(stderr, "%d puzzles (%d solved, %d skipped) in %f s (%f s OpenCL setup): %f puzzles/s\n",
+            count, solved, skipped, elapsed, setup_elapsed, count / elapsed);
+    if (launched > 0)
+        fprintf(stderr, "Mean load imbalance over %d launches: %f\n", launched, imbalance / launched);
+    print_timings();
+    print_task_stats();
+
+    freeBuffers(buffers[0]);
+    freeBuffers(buffers[1]);
+    arena_free(&arenas[0]);
+    arena_free(&arenas[1]);
+    clReleaseCommandQueue(queues[1]);
+    free_template(&dlx_template);
+    release_kernel_variants(&info);
+    freeInfo(info);
+    if (csv_file != NULL)
+        fclose(csv_file);
+    close_board_stream(&stream);
+    return 0;
+}
+
+// Solve the puzzles of a stream boards_per_launch at a time, each group packed into one launch of
+// exact_cover_multi_kernel. A group is closed early when its tasks, its dancing links or its dlx
+// copies would outgrow the largest buffer the device can allocate.
+int solve_multi(const char *file_name, int lws, int boards_per_launch, const char *csv) {
+    struct BoardStream stream;
+    if (!open_board_stream(file_name, &stream))
+        return 1;
+    if (boards_per_launch < 1)
+        boards_per_launch = 1;
+    FILE *csv_file = *csv != 0 ? fopen(csv, "a") : NULL;
+    verbose = 0;
+
+    double start_time = wall_time_us();
+    struct Info info = initialize(NULL, NULL, NULL);
+    struct Buffers buffers = {0};
+    struct Arena arena = {0}; // setup structures of the group being gathered
+    cl_ulong max_alloc;
+    clGetDeviceInfo(info.device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+    double setup_elapsed = (wall_time_us() - start_time) / 1000000;
+    timings.setup += setup_elapsed * 1000000;
+
+    struct Puzzle *puzzles = (struct Puzzle *) malloc(boards_per_launch * sizeof(struct Puzzle));
+    int *prepared = (int *) malloc(boards_per_launch * sizeof(int));
+    int n, count = 0, solved = 0, skipped = 0, launches = 0;
+    int group = 0; // puzzles gathered for the next launch
+    size_t scratch_bytes = 0, group_tasks = 0, group_nodes = 0;
+    int group_depth = 1;
+    int more = 1;
+
+    while (more) {
+        int *board = next_board(&stream, &n);
+        more = board != NULL;
+        int launch = !more;
+
+        if (more) {
+            struct Puzzle *puzzle = &puzzles[group];
+            prepared[group] = prepare_puzzle(board, n, puzzle, &arena);
+
+            // with 32-bit links, which bounds the copies of a group of 16-bit ones
+            int search = prepared[group] == PREPARE_SEARCH;
+            size_t bytes = search && !lean ?
+                           (size_t) puzzle->task_count * puzzle->dlx_size * DLX_PLANES * sizeof(int) : 0;
+            size_t tasks = search ? group_tasks + puzzle->task_count : group_tasks;
+            size_t nodes = search ? group_nodes + puzzle->dlx_size : group_nodes;
+            int depth = search && puzzle->task_depth > group_depth ? puzzle->task_depth : group_depth;
+            if (group > 0 && (scratch_bytes + bytes > max_alloc || tasks * depth * sizeof(int) > max_alloc ||
+                              nodes * DLX_PLANES * sizeof(int) > max_alloc)) {
+                // launch what has been gathered so far, this puzzle opens the next group
+                struct Puzzle last = puzzles[group];
+                int last_prepared = prepared[group];
+                solved += solve_group(puzzles, prepared, group, lws, &info, &buffers, csv_file, &skipped);
+                ++launches;
+                puzzles[0] = last;
+                prepared[0] = last_prepared;
+                group = 0;
+                scratch_bytes = 0;
+                tasks = search ? puzzle->task_count : 0;
+                nodes = search ? puzzle->dlx_size : 0;
+                depth = search && puzzle->task_depth > 1 ? puzzle->task_depth : 1;
+            }
+            scratch_bytes += bytes;
+            group_tasks = tasks;
+            group_nodes = nodes;
+            group_depth = depth;
+            ++group;
+            ++count;
+            launch = group == boards_per_launch;
+        }
+
+        if (launch && group > 0) {
+            solved += solve_group(puzzles, prepared, group, lws, &info, &buffers, csv_file, &skipped);
+            ++launches;
+            group = 0;
+            scratch_bytes = 0;
+            group_tasks = 0;
+            group_nodes = 0;
+            group_depth = 1;
+            // only reset here: a group closed early hands its last puzzle, still in the arena, to the next one
+            arena_reset(&arena);
+        }
+    }
+    double elapsed = (wall_time_us() - start_time) / 1000000;
+
+    fprintf(stderr, "%d puzzles (%d solved, %d skipped) in %d launches, %f s (%f s OpenCL setup): %f puzzles/s\n",
+            count, solved, skipped, launches, elapsed, setup_elapsed, count / elapsed);
+    print_timings();
+    print_task_stats();
+
+    free(prepared);
+    free(puzzles);
+    freeBuffers(buffers);
+    arena_free(&arena);
+    free_template(&dlx_template);
+    release_kernel_variants(&info);
+    freeInfo(info);
+    if (csv_file != NULL)
+        fclose(csv_file);
+    close_board_stream(&stream);
+    return 0;
+}
+
+// make sure *buffer holds at least bytes, replacing it with a bigger one otherwise
+void reserve_buffer(cl_context ctx, cl_mem *buffer, size_t *capacity, size_t bytes, cl_mem_flags flags,
+                    const char *name) {
+    if (*buffer != NULL && *capacity >= bytes)
+        return;
+
+    cl_int err;
+    if (*buffer != NULL)
+        clReleaseMemObject(*buffer);
+    *buffer = clCreateBuffer(ctx, flags, bytes, NULL, &err);
+    ocl_check(err, "create buffer for %s", name);
+    *capacity = bytes;
+}
+
+void freeBuffers(struct Buffers buffers) {
+    cl_mem all[] = {buffers.tasks, buffers.dlx, buffers.dlx_props, buffers.answer_data, buffers.answer, buffers.dlxs,
+                    buffers.task_puzzle, buffers.puzzles, buffers.scratch_offsets, buffers.queue, buffers.loads,
+                    buffers.stats};
+    for (int i = 0; i < 12; ++i)
+        if (all[i] != NULL)
+            clReleaseMemObject(all[i]);
+}
+
+// zero the counters of task_count tasks before a launch. The queue runs in order, so the kernel
+// enqueued next on it sees them cleared.
+void clear_task_stats(cl_context context, cl_command_queue queue, struct Buffers *buffers, int task_count) {
+    size_t bytes = (size_t) task_count * STAT_FIELDS * sizeof(cl_uint);
+    cl_uint zero = 0;
+
+    reserve_buffer(context, &buffers->stats, &buffers->stats_bytes, bytes,
+                   CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, "stats");
+    cl_int err = clEnqueueFillBuffer(queue, buffers->stats, &zero, sizeof(zero), 0, bytes, 0, NULL, NULL);
+    ocl_check(err, "clear stats");
+}
+
+// read the counters of a launch back into task_stats
+void add_task_stats(cl_command_queue queue, struct Buffers *buffers, int task_count, cl_event kernel_evt) {
+    cl_uint *stats = (cl_uint *) malloc((size_t) task_count * STAT_FIELDS * sizeof(cl_uint));
+    cl_int err = clEnqueueReadBuffer(queue, buffers->stats, CL_TRUE, 0,
+                                     (size_t) task_count * STAT_FIELDS * sizeof(cl_uint), stats,
+                                     1, &kernel_evt, NULL);
+    ocl_check(err, "read stats");
+
+    for (int t = 0; t < task_count; ++t) {
+        const cl_uint *counters = stats + (size_t) t * STAT_FIELDS;
+        cl_uint nodes = counters[STAT_NODES];
+        ++task_stats.tasks;
+        if (nodes == 0 && counters[STAT_PUSHES] == 0) {
+            ++task_stats.idle;
+            continue;
+        }
+        for (int f = 0; f < STAT_FIELDS; ++f)
+            task_stats.totals[f] += counters[f];
+        if (nodes > task_stats.max_nodes)
+            task_stats.max_nodes = nodes;
+
+        int bucket = 0;
+        while (nodes > 1) {
+            nodes >>= 1;
+            ++bucket;
+        }
+        ++task_stats.buckets[bucket];
+    }
+    free(stats);
+}
+
+// Print the totals of the counters and a histogram of the nodes touched per task, on stderr so
+// that the solution lines of --batch and --multi stay clean. The skew is the busiest task over
+// the mean of the searched ones.
+void print_task_stats() {
+    if (!instrument || task_stats.tasks == 0)
+        return;
+
+    int searched = task_stats.tasks - task_stats.idle;
+    double mean = searched > 0 ? task_stats.totals[STAT_NODES] / searched : 0;
+    fprintf(stderr, "Instrumented tasks: %d (%d never searched)\n", task_stats.tasks, task_stats.idle);
+    fprintf(stderr, "  pushes %.0f, pops %.0f, column removes %.0f, restores %.0f, nodes touched %.0f\n",
+            task_stats.totals[STAT_PUSHES], task_stats.totals[STAT_POPS], task_stats.totals[STAT_REMOVES],
+            task_stats.totals[STAT_RESTORES], task_stats.totals[STAT_NODES]);
+    fprintf(stderr, "  nodes touched per searched task: mean %.1f, max %u (skew %.2f)\n",
+            mean, task_stats.max_nodes, mean > 0 ? task_stats.max_nodes / mean : 0);
+
+    int most = 0;
+    for (int b = 0; b < STAT_BUCKETS; ++b)
+        if (task_stats.buckets[b] > most)
+            most = task_stats.buckets[b];
+    for (int b = 0; b < STAT_BUCKETS; ++b) {
+        if (task_stats.buckets[b] == 0)
+            continue;
+        int bar = (int) ((50.0 * task_stats.buckets[b] + most - 1) / most);
+        fprintf(stderr, "  %10.0f - %-10.0f %8d ", (double) (1ull << b), (double) (2ull << b) - 1,
+                task_stats.buckets[b]);
+        for (int i = 0; i < bar; ++i)
+            fputc('#', stderr);
+        fputc('\n', stderr);
+    }
+}
+
+// uints of the lean kernels' cover bitset: one bit per column indicator, the last of them being left[0]
+int cover_words(const int *dlx, int dlx_size) {
+    return LINK_PLANE(dlx, 2, dlx_size)[0] / 32 + 1;
+}
+
+// copy of count links (or sizes) narrowed to the cl_ushort of the DLX_LINK16 kernels
+cl_ushort *narrow_links(const int *links, size_t count) {
+    cl_ushort *narrow = (cl_ushort *) malloc(count * sizeof(cl_ushort));
+    for (size_t i = 0; i < count; ++i)
+        narrow[i] = (cl_ushort) links[i];
+    return narrow;
+}
+
+// Fill the forced cells of a board, then turn it into its dancing links and top-level tasks
+// (with --template, cover its clues on a copy of the template instead).
+// The dancing links and the convert table are allocated from arena, and live as long as its
+// allocations. Returns one of the PREPARE_* results.
+int prepare_puzzle(const int *board, int n, struct Puzzle *puzzle, struct Arena *arena) {
     int N = n * n;
     struct MemoryString memory;
 
-    task.size = N;
-    task.lws = lws;
+    *puzzle = (struct Puzzle) {N, 0, NULL, NULL, 0, 0, NULL, malloc(N * N * sizeof(int))};
+    memcpy(puzzle->board, board, N * N * sizeof(int));
 
-    //region Initialize dlx
-    printf("Initializing dlx...\n");
-    int *col_ids, *row_ids, *convert_table;
+    double phase_start = wall_time_us(), phase_end;
+    int *convert_table;
     int *dlx;
-    int placed;
-    int **valid_candidates = (int **) malloc(N * N * sizeof(int *));
-
-    for (int i = 0; i < N * N; ++i) {
-        valid_candidates[i] = (int *) calloc(N, sizeof(int));
+    int dlx_size, num_cols;
+
+    if (use_template) {
+        //region Cover the clues on the template
+        load_template(&dlx_template, n);
+        int clues = apply_template(&dlx_template, board, &dlx, &convert_table, arena);
+        LOG("Covered %d clues of the template\n", clues);
+        if (clues < 0 || clues == N * N)
+            return clues < 0 ? PREPARE_FAILED : PREPARE_SOLVED;
+        dlx_size = dlx_template.dlx_size;
+        num_cols = 4 * N * N;
+        //endregion
+    } else {
+        //region Propagation
+        int placed;
+        unsigned char *valid_candidates = initial_check(board, n, &placed, arena);
+
+        int filled = propagate(puzzle->board, n, valid_candidates, &placed);
+        LOG("Propagation filled %d cells\n", filled);
+        phase_end = wall_time_us();
+        timings.setup += phase_end - phase_start;
+        phase_start = phase_end;
+        if (filled < 0 || placed == N * N)
+            return filled < 0 ? PREPARE_FAILED : PREPARE_SOLVED;
+        //endregion
+
+        //region Initialize dlx
+        LOG("Initializing dlx...\n");
+        dlx_size = build_board_links(puzzle->board, valid_candidates, n, &dlx, &convert_table, arena);
+        num_cols = 4 * (N * N - placed); // the 4 constraints of every empty cell
+        //endregion
     }
-    initial_check(board, n, valid_candidates, &placed);
+    int *row = dlx + DLX_PLANES * dlx_size + dlx_size;
 
-    int num_elems = convert_matrix(board, valid_candidates, placed, n, &col_ids, &row_ids, &convert_table);
-    int dlx_size = build_dancing_links(col_ids, row_ids, num_elems, &dlx);
-    int *dlx_props = dlx + 4 * dlx_size;
-    int *row = dlx_props + dlx_size;
+    memory = memory_string((size_t) dlx_size * DLX_PLANES * sizeof(int));
+    LOG("Number of nodes in dancing links: %d (~%zu %s)\n", dlx_size,
+        memory.value, memory.unit);
 
-    memory = memory_string(dlx_size * 4 * sizeof(int));
+    puzzle->dlx_size = dlx_size;
+    puzzle->dlx = dlx;
+    puzzle->convert_table = convert_table;
 
-    printf("Number of nodes in dancing links: %d (~%llu %s)\n", dlx_size,
-           memory.value, memory.unit);
-    //endregion
+    phase_end = wall_time_us();
+    timings.build += phase_end - phase_start;
+    phase_start = phase_end;
 
     //region Generate tasks
-    int estimated_tasks_count = dlx_size - N * N - 1;
+    int *tasks;
+    int c_tasks_count, task_depth = 1;
+
+    if (split_depth > 0 || split_tasks > 0 || solution_limit != 1) {
+        int max_depth = split_depth > 0 ? split_depth : N * N;
+        int target_count = split_tasks > 0 ? split_tasks : split_depth > 0 ? INT_MAX : COUNT_SPLIT_TASKS;
+
+        LOG("Expanding tasks (%d levels, %d tasks at most)...\n", max_depth, target_count);
+        c_tasks_count = expand_tasks(dlx, dlx_size, max_depth, target_count, &tasks, &task_depth);
+        puzzle->tasks = tasks;
+        if (c_tasks_count == 0) {
+            LOG("No task left: the board has no solution.\n");
+            return PREPARE_FAILED;
+        }
+    } else {
+        // one task per node below a column indicator
+        int estimated_tasks_count = dlx_size - num_cols - 1;
 
-    memory = memory_string(dlx_size * 4 * estimated_tasks_count * sizeof(int));
-    printf("Generating %d tasks (taking ~%llu %s of memory)...\n", estimated_tasks_count, memory.value, memory.unit);
+        memory = memory_string((size_t) dlx_size * DLX_PLANES * estimated_tasks_count * sizeof(int));
+        LOG("Generating %d tasks (taking ~%zu %s of memory)...\n", estimated_tasks_count, memory.value, memory.unit);
 
-    int *tasks = (int *) malloc(estimated_tasks_count * sizeof(int));
+        tasks = (int *) malloc(estimated_tasks_count * sizeof(int));
+        puzzle->tasks = tasks;
 
-    int c_tasks_count = permutate_tasks(dlx, dlx_size, tasks, estimated_tasks_count);
-    task.tasks = c_tasks_count;
-    if (c_tasks_count > estimated_tasks_count) {
-        fprintf(stderr, "Too many tasks generated: %d > %d\n", c_tasks_count, estimated_tasks_count);
-        return task;
-    }
-    if (c_tasks_count < 0) {
-        fprintf(stderr, "Unknown error: Alredy solved?.\n");
-        return task;
+        c_tasks_count = permutate_tasks(dlx, dlx_size, tasks, estimated_tasks_count);
+        if (c_tasks_count > estimated_tasks_count) {
+            fprintf(stderr, "Too many tasks generated: %d > %d\n", c_tasks_count, estimated_tasks_count);
+            return PREPARE_FAILED;
+        }
+        if (c_tasks_count < 0) {
+            fprintf(stderr, "Unknown error: Alredy solved?.\n");
+            return PREPARE_FAILED;
+        }
     }
+    puzzle->task_count = c_tasks_count;
+    puzzle->task_depth = task_depth;
 
-    for (int i = 0; i < c_tasks_count; ++i) {
+    for (int i = 0; i < c_tasks_count * task_depth; ++i) {
+        if (tasks[i] < 0)
+            continue;
         int r = row[tasks[i]];
 
         if (convert_table[r] / N > N * N) {
             fprintf(stderr, "Invalid task %d: %d -> %d (%d: %d)\n",
-                    i, r, convert_table[r], convert_table[r] / N,
+                    i / task_depth, r, convert_table[r], convert_table[r] / N,
                     convert_table[r] % N + 1);
 
-            return task;
+            return PREPARE_FAILED;
         }
     }
 
-    memory = memory_string(dlx_size * 4 * c_tasks_count * sizeof(int));
-    printf("%d tasks generated (taking ~%llu %s of memory).\n", c_tasks_count, memory.value, memory.unit);
+    memory = memory_string((size_t) dlx_size * DLX_PLANES * c_tasks_count * sizeof(int));
+    timings.tasks += wall_time_us() - phase_start;
+    LOG("%d tasks of depth %d generated (taking ~%zu %s of memory).\n", c_tasks_count, task_depth,
+        memory.value, memory.unit);
     //endregion
 
-    //region GPU Search
-
-    printf("Starting GPU search...\n");
-
-    //region Initialization
-    cl_int err;
-    int *answer_data = (int *) malloc(sizeof(int) * 2);
-    answer_data[0] = -1;
-    answer_data[1] = 0;
-
-    struct Info info = initialize("dlx_kernels.cl", "exact_cover_kernel");
+    return PREPARE_SEARCH;
+}
 
-    cl_mem d_tasks = clCreateBuffer(info.context, CL_MEM_READ_WRITE | CL_MEM_HOST_WRITE_ONLY | CL_MEM_USE_HOST_PTR,
-                                    c_tasks_count * sizeof(int), tasks, &err);
-    ocl_check(err, "create buffer for tasks");
+// write the board of the puzzle, then the numbers of the task_id prefix and of the answer rows found
+// below it (node ids), into solution
+void rebuild_solution(const struct Puzzle *puzzle, int task_id, const int *answer, int answer_length,
+                      int *solution) {
+    memcpy(solution, puzzle->board, puzzle->N * puzzle->N * sizeof(int));
+    const int *row = puzzle->dlx + puzzle->dlx_size * (DLX_PLANES + 1);
+    const int *prefix = puzzle->tasks + task_id * puzzle->task_depth;
+
+    for (int i = 0; i < puzzle->task_depth && prefix[i] >= 0; ++i) {
+        int r = row[prefix[i]];
+        convert_answer_board(&r, 1, puzzle->convert_table, puzzle->N, solution);
+    }
+    for (int i = 0; i < answer_length; ++i) {
+        int r = row[answer[i]];
+        convert_answer_board(&r, 1, puzzle->convert_table, puzzle->N, solution);
+    }
+}
 
-    cl_mem d_dlx = clCreateBuffer(info.context, CL_MEM_READ_WRITE | CL_MEM_HOST_WRITE_ONLY | CL_MEM_USE_HOST_PTR,
-                                  dlx_size * 4 * sizeof(int), dlx, &err);
-    ocl_check(err, "create buffer for dlx");
+// solutions of a board from its answer_data fields, the work-items may count a few more than the limit
+unsigned int count_solutions(const int *fields) {
+    unsigned int solutions = (unsigned int) fields[ANSWER_SOLUTIONS];
+    return solution_limit != 0 && solutions > solution_limit ? solution_limit : solutions;
+}
 
-    cl_mem d_dlx_props = clCreateBuffer(info.context,
-                                        CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY | CL_MEM_USE_HOST_PTR,
-                                        dlx_size * 2 * sizeof(int), dlx_props, &err);
-    ocl_check(err, "create buffer for dlx_props");
+// add the profiled copies and kernel of a launch to the timings
+void add_device_timings(struct Task task) {
+    cl_ulong transfer = task.write_answer_data_nanoseconds + task.write_tasks_nanoseconds +
+                        task.write_dlx_nanoseconds + task.write_dlx_props_nanoseconds +
+                        task.read_answer_found_nanoseconds + task.read_answer_nanoseconds;
+    timings.transfer += (double) transfer / 1000;
+    timings.search += (double) task.kernel_nanoseconds / 1000;
+}
 
-    cl_mem d_answer_data = clCreateBuffer(info.context,
-                                          CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
-                                          sizeof(int) * 2, answer_data, &err);
-    ocl_check(err, "create buffer for answer_data");
+// the dancing links and convert table go with the arena of prepare_puzzle
+void free_puzzle(struct Puzzle puzzle) {
+    free(puzzle.tasks);
+    free(puzzle.board);
+}
 
-    cl_mem d_answer = clCreateBuffer(info.context, CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY,
-                                     N * N * sizeof(int),
-                                     NULL, &err);
-    ocl_check(err, "create buffer for answer");
+// Solve a single puzzle on the queue of info: launch_puzzle, then finish_puzzle
+struct Task solve(const int *board, int n, int lws, struct Info *info, struct Buffers *buffers, int *solution) {
+    struct Flight flight;
+    struct Arena arena = {0};
+    launch_puzzle(&flight, board, n, lws, info, info->queue, buffers, &arena, solution);
+    struct Task task = finish_puzzle(&flight);
+    arena_free(&arena);
+    return task;
+}
 
-    cl_mem d_dlxs = clCreateBuffer(info.context, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS,
-                                   dlx_size * 4 * c_tasks_count * sizeof(int), NULL, &err);
-    ocl_check(err, "create buffer for dlxs");
+// Prepare a board and enqueue its writes and kernel on queue, searching in buffers, without waiting
+// for them: finish_puzzle reads the answer back. The setup structures of the board are allocated
+// from arena, reset first, so the puzzle previously launched with it must be finished. A board
+// settled by propagation alone is written to solution right away.
+void launch_puzzle(struct Flight *flight, const int *board, int n, int lws, struct Info *info,
+                   cl_command_queue queue, struct Buffers *buffers, struct Arena *arena, int *solution) {
+    int N = n * n;
+    struct MemoryString memory;
+    struct Task *task = &flight->task;
+    struct Puzzle *puzzle = &flight->puzzle;
+
+    *flight = (struct Flight) {0};
+    flight->buffers = buffers;
+    flight->queue = queue;
+    flight->solution = solution;
+    task->size = N;
+    task->lws = lws;
+
+    arena_reset(arena);
+    int prepared = prepare_puzzle(board, n, puzzle, arena);
+    task->tasks = puzzle->task_count;
+    if (prepared == PREPARE_SOLVED) {
+        // no kernel to launch
+        LOG("Solved by propagation.\n");
+        memcpy(solution, puzzle->board, N * N * sizeof(int));
+        if (verbose)
+            print_board(solution, N);
+        task->found = 1;
+        task->solutions = 1; // every filled cell was forced
+        task->completed = 1;
+    }
+    if (prepared != PREPARE_SEARCH)
+        return;
 
-    task.write_answer_data_byte = sizeof(int) * 2;
-    task.write_tasks_byte = c_tasks_count * sizeof(int);
-    task.write_dlx_byte = dlx_size * 4 * sizeof(int);
-    task.write_dlx_props_byte = dlx_size * 2 * sizeof(int);
-    task.write_dlxs_byte = dlx_size * 4 * c_tasks_count * sizeof(int);
+    int dlx_size = puzzle->dlx_size;
+    int *dlx = puzzle->dlx;
+    int *dlx_props = dlx + DLX_PLANES * dlx_size;
+    int *tasks = puzzle->tasks;
+    int c_tasks_count = puzzle->task_count;
+    size_t tasks_bytes = (size_t) c_tasks_count * puzzle->task_depth * sizeof(int);
 
-    memory = memory_string(c_tasks_count * sizeof(int));
-    printf("Device buffer tasks size: %d (%llu %s)\n", c_tasks_count, memory.value, memory.unit);
+    //region GPU Search
 
-    memory = memory_string(dlx_size * 4 * sizeof(int));
-    printf("Device buffer dlx size: %d (%llu %s)\n", dlx_size * 4, memory.value, memory.unit);
+    LOG("Starting GPU search...\n");
 
-    memory = memory_string(dlx_size * 4 * c_tasks_count * sizeof(int));
-    printf("Device buffer dlxs size: %d (%llu %s)\n", dlx_size * 4 * c_tasks_count, memory.value, memory.unit);
+    //region Initialization
+    cl_int err;
+    int *answer_data = flight->answer_data;
+    answer_data[ANSWER_FOUND] = -1;
+    int link16 = dlx_size <= LINK16_MAX_NODES;
+    size_t link_bytes = link16 ? sizeof(cl_ushort) : sizeof(int);
+    size_t dlx_bytes = (size_t) dlx_size * DLX_PLANES * link_bytes;
+    size_t dlx_props_bytes = (size_t) dlx_size * 2 * sizeof(int);
+    size_t copy_bytes = dlx_bytes;
+
+    // big boards: the stacks must fit in local memory, and every buffer in one device allocation.
+    // A board that cannot is reported and skipped.
+    cl_ulong max_alloc = max_alloc_size(info);
+    size_t item_bytes = (size_t) N * N * sizeof(int) + (lean ? cover_words(dlx, dlx_size) * sizeof(cl_uint) : 0);
+    lws = fit_local_tile(info, item_bytes, lws);
+    if (lws == 0) {
+        fprintf(stderr, "The stack of a work-item (%zu bytes) does not fit in local memory\n", item_bytes);
+        task->skipped = 1;
+        return;
+    }
+    if (!fits_device(tasks_bytes, max_alloc, "tasks") || !fits_device(dlx_bytes, max_alloc, "dlx") ||
+        !fits_device(dlx_props_bytes, max_alloc, "dlx_props")) {
+        task->skipped = 1;
+        return;
+    }
+    int local_dlx = local_dlx_fits(info, copy_bytes, N, lws);
+
+    // the dlx copies in global memory are bounded by max_alloc too: past that, the tasks are
+    // launched in chunks of as many tasks as there are copies, one after the other. A tile whose
+    // copies do not fit in one allocation is shrunk first (a copy is as big as the dlx, which fits).
+    if (!lean && !local_dlx && max_alloc / copy_bytes < (cl_ulong) lws) {
+        int tile = (int) (max_alloc / copy_bytes);
+        LOG("Tile reduced from %d to %d work-items: %zu bytes of dlx copy each\n", lws, tile, copy_bytes);
+        lws = tile;
+        local_dlx = local_dlx_fits(info, copy_bytes, N, lws);
+    }
+    task->lws = lws;
+    size_t max_copies = lean || local_dlx ? (size_t) c_tasks_count : max_alloc / copy_bytes / lws * lws;
+
+    flight->searching = 1;
+    flight->links16 = link16 ? narrow_links(dlx, (size_t) dlx_size * DLX_PLANES) : NULL;
+    specialize_kernel(info, single_kernel_name(), N, link16, local_dlx);
+
+    // a persistent grid needs no more work-groups than there are tasks to fill them (nor, with
+    // global dlx copies, than max_copies allows), and only one dlx copy per work-item
+    size_t groups = 0;
+    int copies = c_tasks_count < max_copies ? c_tasks_count : (int) max_copies;
+    if (persistent) {
+        cl_uint compute_units;
+        err = clGetDeviceInfo(info->device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units,
+                              NULL);
+        ocl_check(err, "get compute units");
+        groups = (c_tasks_count + lws - 1) / lws;
+        if (groups > compute_units)
+            groups = compute_units;
+        if (!lean && !local_dlx && groups > max_copies / lws)
+            groups = max_copies / lws;
+        copies = (int) groups * lws;
+
+        reserve_buffer(info->context, &buffers->queue, &buffers->queue_bytes, sizeof(int),
+                       CL_MEM_READ_WRITE | CL_MEM_HOST_WRITE_ONLY, "queue");
+        reserve_buffer(info->context, &buffers->loads, &buffers->loads_bytes, copies * 2 * sizeof(int),
+                       CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, "loads");
+        LOG("Persistent grid: %zu work-groups of %d\n", groups, lws);
+    }
+    flight->copies = copies;
+
+    reserve_buffer(info->context, &buffers->tasks, &buffers->tasks_bytes, tasks_bytes,
+                   CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "tasks");
+    reserve_buffer(info->context, &buffers->dlx, &buffers->dlx_bytes, dlx_bytes,
+                   CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "dlx");
+    reserve_buffer(info->context, &buffers->dlx_props, &buffers->dlx_props_bytes, dlx_props_bytes,
+                   CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "dlx_props");
+    reserve_buffer(info->context, &buffers->answer_data, &buffers->answer_data_bytes, sizeof(flight->answer_data),
+                   CL_MEM_READ_WRITE, "answer_data");
+    reserve_buffer(info->context, &buffers->answer, &buffers->answer_bytes, N * N * sizeof(int),
+                   CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, "answer");
+    if (!lean && !local_dlx)
+        reserve_buffer(info->context, &buffers->dlxs, &buffers->dlxs_bytes, copy_bytes * (size_t) copies,
+                       CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "dlxs");
+
+    task->write_answer_data_byte = sizeof(flight->answer_data) + (persistent ? sizeof(int) : 0);
+    task->write_tasks_byte = tasks_bytes;
+    task->write_dlx_byte = dlx_bytes;
+    task->write_dlx_props_byte = dlx_props_bytes;
+    task->write_dlxs_byte = lean || local_dlx ? 0 : copy_bytes * (size_t) copies;
+
+    memory = memory_string(tasks_bytes);
+    LOG("Device buffer tasks size: %d (%zu %s)\n", c_tasks_count * puzzle->task_depth, memory.value, memory.unit);
+
+    memory = memory_string(dlx_bytes);
+    LOG("Device buffer dlx size: %d (%zu %s)\n", dlx_size * DLX_PLANES, memory.value, memory.unit);
+
+    if (local_dlx) {
+        memory = memory_string(copy_bytes * lws);
+        LOG("Local dlx copies: %zu (%zu %s)\n", (size_t) dlx_size * DLX_PLANES * lws, memory.value, memory.unit);
+    } else if (!lean) {
+        memory = memory_string(copy_bytes * copies);
+        LOG("Device buffer dlxs size: %zu (%zu %s)\n", (size_t) dlx_size * DLX_PLANES * copies,
+            memory.value, memory.unit);
+    }
 
-    memory = memory_string(dlx_size * 2 * sizeof(int));
-    printf("Device buffer dlx_props size: %d (%llu %s)\n", dlx_size * 2, memory.value, memory.unit);
+    memory = memory_string(dlx_props_bytes);
+    LOG("Device buffer dlx_props size: %d (%zu %s)\n", dlx_size * 2, memory.value, memory.unit);
 
     memory = memory_string(N * N * sizeof(int));
-    printf("Device buffer answer size: %d (%llu %s)\n", N * N, memory.value, memory.unit);
+    LOG("Device buffer answer size: %d (%zu %s)\n", N * N, memory.value, memory.unit);
 
-    memory = memory_string(sizeof(int) * 2);
-    printf("Device buffer answer_data size: %d (%llu %s)\n", 2, memory.value, memory.unit);
+    memory = memory_string(sizeof(flight->answer_data));
+    LOG("Device buffer answer_data size: %d (%zu %s)\n", ANSWER_FIELDS, memory.value, memory.unit);
 
     //endregion
 
     //region Write data to device
-    cl_event evt_maps[4];
-    cl_event evt_unmaps[4];
-
-    clEnqueueMapBuffer(info.queue, d_answer_data,
-                       CL_FALSE, CL_MAP_WRITE, 0, sizeof(int) * 2,
-                       0, NULL, &evt_maps[0], &err);
-    ocl_check(err, "map answer_data");
-
-    clEnqueueMapBuffer(info.queue, d_tasks,
-                       CL_FALSE, CL_MAP_WRITE, 0, c_tasks_count * sizeof(int),
-                       0, NULL, &evt_maps[1], &err);
-    ocl_check(err, "map tasks");
-
-    clEnqueueMapBuffer(info.queue, d_dlx,
-                       CL_FALSE, CL_MAP_WRITE, 0, dlx_size * 4 * sizeof(int),
-                       0, NULL, &evt_maps[2], &err);
-    ocl_check(err, "map dlx");
-
-    clEnqueueMapBuffer(info.queue, d_dlx_props,
-                       CL_FALSE, CL_MAP_WRITE, 0, dlx_size * 2 * sizeof(int),
-                       0, NULL, &evt_maps[3], &err);
-    ocl_check(err, "map dlx_props");
-
-    // Unmapping data
-
-    err = clEnqueueUnmapMemObject(info.queue, d_answer_data, answer_data,
-                                  1, &evt_maps[0], &evt_unmaps[0]);
-    ocl_check(err, "unmap answer_data");
-
-    err = clEnqueueUnmapMemObject(info.queue, d_tasks, tasks,
-                                  1, &evt_maps[1], &evt_unmaps[1]);
-    ocl_check(err, "unmap tasks");
-
-    err = clEnqueueUnmapMemObject(info.queue, d_dlx, dlx,
-                                  1, &evt_maps[2], &evt_unmaps[2]);
-    ocl_check(err, "unmap dlx");
-
-    err = clEnqueueUnmapMemObject(info.queue, d_dlx_props, dlx_props,
-                                  1, &evt_maps[3], &evt_unmaps[3]);
-    ocl_check(err, "unmap dlx_props");
+    // the buffers outlive this puzzle, so the data is written into them instead of mapping host pointers.
+    // The writes are not blocking: what they read stays in the flight until finish_puzzle.
+    cl_event *evt_writes = flight->evt_writes;
+    flight->write_count = persistent ? 5 : 4;
+
+    err = clEnqueueWriteBuffer(queue, buffers->answer_data, CL_FALSE, 0, sizeof(flight->answer_data), answer_data,
+                               0, NULL, &evt_writes[0]);
+    ocl_check(err, "write answer_data");
+
+    err = clEnqueueWriteBuffer(queue, buffers->tasks, CL_FALSE, 0, tasks_bytes, tasks,
+                               0, NULL, &evt_writes[1]);
+    ocl_check(err, "write tasks");
+
+    err = clEnqueueWriteBuffer(queue, buffers->dlx, CL_FALSE, 0, dlx_bytes,
+                               link16 ? (const void *) flight->links16 : dlx, 0, NULL, &evt_writes[2]);
+    ocl_check(err, "write dlx");
+
+    err = clEnqueueWriteBuffer(queue, buffers->dlx_props, CL_FALSE, 0, dlx_props_bytes, dlx_props,
+                               0, NULL, &evt_writes[3]);
+    ocl_check(err, "write dlx_props");
+
+    if (persistent) {
+        err = clEnqueueWriteBuffer(queue, buffers->queue, CL_FALSE, 0, sizeof(int), &flight->queue_start,
+                                   0, NULL, &evt_writes[4]);
+        ocl_check(err, "write queue");
+    }
     //endregion
 
+    if (instrument)
+        clear_task_stats(info->context, queue, buffers, c_tasks_count);
+
     // print dlx
     // printf("Host DLX (%d):\n", dlx_size);
     // for (int i = 0; i < dlx_size; ++i) {
     //     printf("%d: u%d d%d l%d r%d\n", i, dlx[i], dlx[i + dlx_size], dlx[i + dlx_size * 2], dlx[i + dlx_size * 3]);
     // }
 
-    cl_event kernel_evt = execute_exact_cover_kernel(
-            info.queue, info.kernel,
-            c_tasks_count, lws, n,
-            d_tasks, d_dlx, d_dlxs, d_dlx_props,
-            dlx_size, d_answer, d_answer_data,
-            evt_unmaps, 4);
+    // one launch, unless the tasks outnumber the copies of the dlxs buffer: the chunks then run one
+    // after the other on the queue, and the later ones return at once when an earlier one was enough
+    size_t chunk = persistent ? (size_t) c_tasks_count : (size_t) copies;
+    flight->chunk_count = (int) ((c_tasks_count + chunk - 1) / chunk);
+    flight->chunk_evts = flight->chunk_count > 1 ? malloc((flight->chunk_count - 1) * sizeof(cl_event)) : NULL;
+    if (flight->chunk_count > 1)
+        LOG("Launching %d tasks in %d chunks of %zu\n", c_tasks_count, flight->chunk_count, chunk);
+    for (int c = 0; c < flight->chunk_count; ++c) {
+        size_t first_task = c * chunk;
+        size_t launch_tasks = c_tasks_count - first_task < chunk ? c_tasks_count - first_task : chunk;
+        cl_event kernel_evt = execute_exact_cover_kernel(
+                queue, info->kernel,
+                c_tasks_count, first_task, launch_tasks, lws, n,
+                buffers->tasks, buffers->dlx, buffers->dlxs, local_dlx ? copy_bytes : 0, buffers->dlx_props,
+                dlx_size, buffers->answer, buffers->answer_data, puzzle->task_depth, solution_limit,
+                lean ? cover_words(dlx, dlx_size) : 0, buffers->queue, buffers->loads, groups,
+                instrument ? buffers->stats : NULL, evt_writes, flight->write_count);
+        if (c + 1 < flight->chunk_count)
+            flight->chunk_evts[c] = kernel_evt;
+        else
+            flight->kernel_evt = kernel_evt;
+    }
+
+    // start the device on it while the host goes on
+    err = clFlush(queue);
+    ocl_check(err, "flush queue");
+}
+
+// Wait for the kernel of a launched puzzle, read its answer back into the solution of the flight
+// and free what the launch kept. Returns the task of the puzzle.
+struct Task finish_puzzle(struct Flight *flight) {
+    struct Task task = flight->task;
+    struct Puzzle *puzzle = &flight->puzzle;
+    struct Buffers *buffers = flight->buffers;
+    cl_command_queue queue = flight->queue;
+    cl_event kernel_evt = flight->kernel_evt;
+    int *solution = flight->solution;
+    int N = puzzle->N;
+    int copies = flight->copies;
+    cl_int err;
+
+    if (!flight->searching) {
+        free_puzzle(*puzzle);
+        return task;
+    }
 
     //region Read answer
 
     cl_event read_answer_found_evt;
-    clEnqueueMapBuffer(info.queue, d_answer_data,
-                       CL_TRUE, CL_MAP_READ, 0, sizeof(int) * 2,
-                       1, &kernel_evt, &read_answer_found_evt, &err);
+    int *mapped_answer_data = clEnqueueMapBuffer(queue, buffers->answer_data,
+                                                 CL_TRUE, CL_MAP_READ, 0, sizeof(flight->answer_data),
+                                                 1, &kernel_evt, &read_answer_found_evt, &err);
     ocl_check(err, "read answer_data");
 
-    task.read_answer_found_byte = sizeof(int) * 2;
+    task.read_answer_found_byte = sizeof(flight->answer_data);
 
-    printf("GPU search finished.\n");
+    LOG("GPU search finished.\n");
 
-    int answer_found = answer_data[0];
-    int answer_length = answer_data[1];
+    int answer_found = mapped_answer_data[ANSWER_FOUND];
+    int answer_length = mapped_answer_data[ANSWER_LENGTH];
+    task.solutions = count_solutions(mapped_answer_data);
+    if (solution_limit != 1)
+        LOG("Solutions: %u%s\n", task.solutions, limit_suffix(task.solutions));
 
-    clEnqueueUnmapMemObject(info.queue, d_answer_data, answer_data,
+    clEnqueueUnmapMemObject(queue, buffers->answer_data, mapped_answer_data,
                             1, &read_answer_found_evt, NULL);
+    free(flight->links16); // the kernel, and so the write, are done
 
-    if (answer_found && answer_length > 0) {
+    // a task prefix may cover every column by itself, leaving an empty answer
+    if (answer_found >= 0) {
         cl_event read_answer_evt;
-        int *answer = clEnqueueMapBuffer(info.queue, d_answer,
+        int *answer = clEnqueueMapBuffer(queue, buffers->answer,
                                          CL_TRUE, CL_MAP_READ, 0, N * N * sizeof(int),
                                          1, &kernel_evt, &read_answer_evt, &err);
         ocl_check(err, "read answer");
@@ -258,41 +1112,71 @@ struct Task solve(const int *board, int n, int lws) {
         task.read_answer_byte = N * N * sizeof(int);
         task.read_answer_nanoseconds = runtime_ns(read_answer_evt);
 
-        for (int i = 0; i < answer_length; ++i)
-            answer[i] = row[answer[i]]; // convert to row numbers
-        convert_answer_print(row[tasks[answer_found]], answer, convert_table, N
-        );
+        rebuild_solution(puzzle, answer_found, answer, answer_length, solution);
+        if (verbose)
+            print_board(solution, N);
+        task.found = 1;
 
-        clEnqueueUnmapMemObject(info.queue, d_answer, answer,
+        clEnqueueUnmapMemObject(queue, buffers->answer, answer,
                                 1, &read_answer_evt, NULL);
+        clReleaseEvent(read_answer_evt);
     } else {
-        printf("No answer found.\n");
+        LOG("No answer found.\n");
+    }
+    //endregion
+
+    //region Read loads
+    if (persistent) {
+        int *loads = (int *) malloc(copies * 2 * sizeof(int));
+        err = clEnqueueReadBuffer(queue, buffers->loads, CL_TRUE, 0, copies * 2 * sizeof(int), loads,
+                                  1, &kernel_evt, NULL);
+        ocl_check(err, "read loads");
+
+        // imbalance: steps of the busiest work-item over the mean, 1 when the work is spread evenly
+        int min_taken = loads[0], max_taken = loads[0], max_steps = 0;
+        double total_steps = 0;
+        for (int i = 0; i < copies; ++i) {
+            if (loads[i * 2] < min_taken)
+                min_taken = loads[i * 2];
+            if (loads[i * 2] > max_taken)
+                max_taken = loads[i * 2];
+            if (loads[i * 2 + 1] > max_steps)
+                max_steps = loads[i * 2 + 1];
+            total_steps += loads[i * 2 + 1];
+        }
+        task.load_imbalance = total_steps > 0 ? max_steps / (total_steps / copies) : 1;
+        LOG("Work-items took %d to %d tasks, at most %d of %.0f search steps (imbalance %.2f)\n",
+            min_taken, max_taken, max_steps, total_steps, task.load_imbalance);
+        free(loads);
     }
     //endregion
 
-    task.write_answer_data_nanoseconds = runtime_ns(evt_maps[0]);
-    task.write_tasks_nanoseconds = runtime_ns(evt_maps[1]);
-    task.write_dlx_nanoseconds = runtime_ns(evt_maps[2]);
-    task.write_dlx_props_nanoseconds = runtime_ns(evt_maps[3]);
+    if (instrument)
+        add_task_stats(queue, buffers, puzzle->task_count, kernel_evt);
+
+    cl_event *evt_writes = flight->evt_writes;
+    task.write_answer_data_nanoseconds = runtime_ns(evt_writes[0]);
+    if (persistent)
+        task.write_answer_data_nanoseconds += runtime_ns(evt_writes[4]);
+    task.write_tasks_nanoseconds = runtime_ns(evt_writes[1]);
+    task.write_dlx_nanoseconds = runtime_ns(evt_writes[2]);
+    task.write_dlx_props_nanoseconds = runtime_ns(evt_writes[3]);
     task.kernel_nanoseconds = runtime_ns(kernel_evt);
+    for (int c = 0; c + 1 < flight->chunk_count; ++c)
+        task.kernel_nanoseconds += runtime_ns(flight->chunk_evts[c]);
     task.read_answer_found_nanoseconds = runtime_ns(read_answer_found_evt);
+    add_device_timings(task);
 
     //region Free memory
-    freeInfo(info);
-    clReleaseMemObject(d_answer);
-    clReleaseMemObject(d_dlxs);
-    clReleaseMemObject(d_dlx_props);
-    clReleaseMemObject(d_answer_data);
-
-    free(tasks);
-    free(dlx);
-    free(convert_table);
-    free(col_ids);
-    free(row_ids);
-    free(answer_data);
-    for (int i = 0; i < N * N; ++i)
-        free(valid_candidates[i]);
-    free(valid_candidates);
+    for (int i = 0; i < flight->write_count; ++i)
+        clReleaseEvent(evt_writes[i]);
+    for (int c = 0; c + 1 < flight->chunk_count; ++c)
+        clReleaseEvent(flight->chunk_evts[c]);
+    free(flight->chunk_evts);
+    clReleaseEvent(kernel_evt);
+    clReleaseEvent(read_answer_found_evt);
+
+    free_puzzle(*puzzle);
     //endregion
 
     task.completed = 1;
@@ -300,34 +1184,280 @@ struct Task solve(const int *board, int n, int lws) {
     return task;
 }
 
-int permutate_tasks(const int *dlx, int dlx_size, int *tasks, int tasks_size) {
-    const int *b_down = dlx + 1 * dlx_size;
-    const int *b_right = dlx + 3 * dlx_size;
-
-    int count = 0;
-
-    // iterate each column
-    int c_col;
-    for (c_col = b_right[0]; c_col != 0; c_col = b_right[c_col]) {
-        // iterate each row
-        int c_row;
-        for (c_row = b_down[c_col]; c_row != c_col; c_row = b_down[c_row]) {
-            if (count > tasks_size) {
-                fprintf(stderr, "slots not enough: tried to generate %d-th task but only %d slots available.\n",
-                        ++count, tasks_size);
+// Pack the puzzles of a group into shared buffers, solve them with one launch of the multi-puzzle
+// kernel and print one solution line per puzzle, in order. Returns the number of solved puzzles.
+int solve_group(struct Puzzle *puzzles, const int *prepared, int count, int lws,
+                struct Info *info, struct Buffers *buffers, FILE *csv_file, int *skipped) {
+    struct Task task = {0};
+    int solved = 0;
+
+    //region Pack puzzles
+    // the tasks of every puzzle are padded to the deepest prefix of the group
+    int max_N = 0, max_cover_words = 0, task_depth = 1, max_dlx_size = 0;
+    size_t total_tasks = 0, total_nodes = 0;
+    for (int p = 0; p < count; ++p) {
+        if (puzzles[p].N > max_N)
+            max_N = puzzles[p].N;
+        if (prepared[p] == PREPARE_SEARCH) {
+            total_tasks += puzzles[p].task_count;
+            if (puzzles[p].task_depth > task_depth)
+                task_depth = puzzles[p].task_depth;
+            total_nodes += puzzles[p].dlx_size;
+            if (puzzles[p].dlx_size > max_dlx_size)
+                max_dlx_size = puzzles[p].dlx_size;
+            if (cover_words(puzzles[p].dlx, puzzles[p].dlx_size) > max_cover_words)
+                max_cover_words = cover_words(puzzles[p].dlx, puzzles[p].dlx_size);
+        }
+    }
+
+    task.size = max_N;
+    task.lws = lws;
+    task.tasks = (int) total_tasks;
+
+    int *tasks = (int *) malloc(total_tasks * task_depth * sizeof(int));
+    int *task_puzzle = (int *) malloc(total_tasks * sizeof(int));
+    int *puzzle_table = (int *) malloc(count * PUZZLE_FIELDS * sizeof(int));
+    cl_ulong *scratch_offsets = (cl_ulong *) malloc(count * sizeof(cl_ulong));
+    int *dlx = (int *) malloc((size_t) total_nodes * DLX_PLANES * sizeof(int));
+    int *dlx_props = (int *) malloc((size_t) total_nodes * 2 * sizeof(int));
+    int *answer_data = (int *) malloc(count * ANSWER_FIELDS * sizeof(int));
+    int *answers = (int *) malloc((size_t) count * max_N * max_N * sizeof(int));
+
+    size_t node_offset = 0, task_offset = 0;
+    cl_ulong scratch_offset = 0;
+    for (int p = 0; p < count; ++p) {
+        struct Puzzle *puzzle = &puzzles[p];
+        int *entry = puzzle_table + p * PUZZLE_FIELDS;
+
+        int *fields = answer_data + p * ANSWER_FIELDS;
+        fields[ANSWER_FOUND] = -1;
+        fields[ANSWER_LENGTH] = fields[ANSWER_SOLUTIONS] = fields[ANSWER_COUNTED] = 0;
+        // a group whose offsets outgrow an int is solved puzzle by puzzle, and never reads them
+        entry[PUZZLE_NODE_OFFSET] = (int) node_offset;
+        entry[PUZZLE_DLX_SIZE] = prepared[p] == PREPARE_SEARCH ? puzzle->dlx_size : 0;
+        entry[PUZZLE_TASK_OFFSET] = (int) task_offset;
+        scratch_offsets[p] = scratch_offset;
+        if (prepared[p] != PREPARE_SEARCH)
+            continue;
+
+        memcpy(dlx + node_offset * DLX_PLANES, puzzle->dlx, puzzle->dlx_size * DLX_PLANES * sizeof(int));
+        memcpy(dlx_props + node_offset * 2, puzzle->dlx + puzzle->dlx_size * DLX_PLANES,
+               puzzle->dlx_size * 2 * sizeof(int));
+        for (int t = 0; t < puzzle->task_count; ++t) {
+            for (int i = 0; i < task_depth; ++i)
+                tasks[(task_offset + t) * task_depth + i] =
+                        i < puzzle->task_depth ? puzzle->tasks[t * puzzle->task_depth + i] : -1;
+            task_puzzle[task_offset + t] = p;
+        }
+
+        node_offset += puzzle->dlx_size;
+        task_offset += puzzle->task_count;
+        if (!lean)
+            scratch_offset += (cl_ulong) puzzle->task_count * puzzle->dlx_size * DLX_PLANES;
+    }
+    //endregion
+
+    cl_int err;
+    size_t tasks_bytes = total_tasks * task_depth * sizeof(int);
+    size_t task_puzzle_bytes = total_tasks * sizeof(int);
+    size_t puzzles_bytes = count * PUZZLE_FIELDS * sizeof(int);
+    size_t scratch_offsets_bytes = count * sizeof(cl_ulong);
+    // the links of a puzzle index its own nodes, so the widest board decides for the group
+    int link16 = max_dlx_size <= LINK16_MAX_NODES;
+    size_t link_bytes = link16 ? sizeof(cl_ushort) : sizeof(int);
+    size_t dlx_bytes = total_nodes * DLX_PLANES * link_bytes;
+    size_t dlx_props_bytes = total_nodes * 2 * sizeof(int);
+    size_t answer_data_bytes = count * ANSWER_FIELDS * sizeof(int);
+    size_t answer_bytes = (size_t) count * max_N * max_N * sizeof(int);
+    // local copies are strided by the largest board of the group
+    size_t copy_bytes = (size_t) max_dlx_size * DLX_PLANES * link_bytes;
+    size_t item_bytes = (size_t) max_N * max_N * sizeof(int) + (lean ? max_cover_words * sizeof(cl_uint) : 0);
+    int tile = total_tasks > 0 ? fit_local_tile(info, item_bytes, lws) : lws;
+    int local_dlx = tile > 0 && local_dlx_fits(info, copy_bytes, max_N, tile);
+    size_t dlxs_bytes = local_dlx ? 0 : scratch_offset * link_bytes;
+
+    // A group that does not fit one launch (a buffer past the largest allocation, offsets past an int,
+    // or stacks past the local memory) is solved puzzle by puzzle with solve instead: like the puzzles
+    // of --batch, each one gets a smaller tile, chunked launches or is skipped.
+    cl_ulong max_alloc = max_alloc_size(info);
+    int one_by_one = total_tasks > 0 &&
+                     (tile == 0 || total_tasks > INT_MAX || total_nodes * DLX_PLANES > INT_MAX ||
+                      tasks_bytes > max_alloc || dlx_bytes > max_alloc || dlx_props_bytes > max_alloc ||
+                      answer_bytes > max_alloc || (!lean && !local_dlx && dlxs_bytes > max_alloc));
+    if (one_by_one)
+        fprintf(stderr, "A group of %d puzzles does not fit one launch: solving them one by one\n", count);
+
+    if (total_tasks > 0 && !one_by_one) {
+        cl_ushort *links16 = link16 ? narrow_links(dlx, total_nodes * DLX_PLANES) : NULL;
+        task.lws = tile;
+
+        //region Initialization
+        specialize_kernel(info, lean ? "exact_cover_lean_multi_kernel" : "exact_cover_multi_kernel", max_N,
+                          link16, local_dlx);
+        reserve_buffer(info->context, &buffers->tasks, &buffers->tasks_bytes, tasks_bytes,
+                       CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "tasks");
+        reserve_buffer(info->context, &buffers->task_puzzle, &buffers->task_puzzle_bytes, task_puzzle_bytes,
+                       CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "task_puzzle");
+        reserve_buffer(info->context, &buffers->puzzles, &buffers->puzzles_bytes, puzzles_bytes,
+                       CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "puzzles");
+        if (!lean && !local_dlx)
+            reserve_buffer(info->context, &buffers->scratch_offsets, &buffers->scratch_offsets_bytes,
+                           scratch_offsets_bytes, CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "scratch_offsets");
+        reserve_buffer(info->context, &buffers->dlx, &buffers->dlx_bytes, dlx_bytes,
+                       CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "dlx");
+        reserve_buffer(info->context, &buffers->dlx_props, &buffers->dlx_props_bytes, dlx_props_bytes,
+                       CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "dlx_props");
+        reserve_buffer(info->context, &buffers->answer_data, &buffers->answer_data_bytes, answer_data_bytes,
+                       CL_MEM_READ_WRITE, "answer_data");
+        reserve_buffer(info->context, &buffers->answer, &buffers->answer_bytes, answer_bytes,
+                       CL_MEM_WRITE_ONLY | CL_MEM_HOST_READ_ONLY, "answer");
+        if (!lean && !local_dlx)
+            reserve_buffer(info->context, &buffers->dlxs, &buffers->dlxs_bytes, dlxs_bytes,
+                           CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "dlxs");
+
+        task.write_answer_data_byte = answer_data_bytes;
+        task.write_tasks_byte = tasks_bytes + task_puzzle_bytes + puzzles_bytes +
+                                (lean || local_dlx ? 0 : scratch_offsets_bytes);
+        task.write_dlx_byte = dlx_bytes;
+        task.write_dlx_props_byte = dlx_props_bytes;
+        task.write_dlxs_byte = dlxs_bytes;
+        //endregion
+
+        //region Write data to device
+        // the scratch offsets come last, neither the lean kernel nor local copies have a use for them
+        int write_count = lean || local_dlx ? 6 : 7;
+        cl_event evt_writes[7];
+        struct {
+            cl_mem buffer;
+            size_t bytes;
+            const void *data;
+        } writes[7] = {
+                {buffers->answer_data,     answer_data_bytes,     answer_data},
+                {buffers->tasks,           tasks_bytes,           tasks},
+                {buffers->task_puzzle,     task_puzzle_bytes,     task_puzzle},
+                {buffers->puzzles,         puzzles_bytes,         puzzle_table},
+                {buffers->dlx,             dlx_bytes,             link16 ? (const void *) links16 : dlx},
+                {buffers->dlx_props,       dlx_props_bytes,       dlx_props},
+                {buffers->scratch_offsets, scratch_offsets_bytes, scratch_offsets},
+        };
+        for (int i = 0; i < write_count; ++i) {
+            err = clEnqueueWriteBuffer(info->queue, writes[i].buffer, CL_FALSE, 0, writes[i].bytes, writes[i].data,
+                                       0, NULL, &evt_writes[i]);
+            ocl_check(err, "write buffer %d", i);
+        }
+        if (instrument)
+            clear_task_stats(info->context, info->queue, buffers, total_tasks);
+        //endregion
+
+        cl_event kernel_evt = execute_exact_cover_multi_kernel(
+                info->queue, info->kernel, total_tasks, tile, max_N,
+                buffers->tasks, buffers->task_puzzle, buffers->puzzles, buffers->scratch_offsets,
+                buffers->dlx, buffers->dlxs, local_dlx ? copy_bytes : 0, max_dlx_size * DLX_PLANES,
+                buffers->dlx_props, buffers->answer, buffers->answer_data, task_depth, solution_limit, lean ? max_cover_words : 0, instrument ? buffers->stats : NULL,
+                evt_writes, write_count);
+
+        //region Read answers
+        cl_event read_answer_found_evt, read_answer_evt;
+        int *mapped_answer_data = clEnqueueMapBuffer(info->queue, buffers->answer_data,
+                                                     CL_TRUE, CL_MAP_READ, 0, answer_data_bytes,
+                                                     1, &kernel_evt, &read_answer_found_evt, &err);
+        ocl_check(err, "read answer_data");
+        int *answer = clEnqueueMapBuffer(info->queue, buffers->answer,
+                                         CL_TRUE, CL_MAP_READ, 0, answer_bytes,
+                                         1, &kernel_evt, &read_answer_evt, &err);
+        ocl_check(err, "read answer");
+
+        task.read_answer_found_byte = answer_data_bytes;
+        task.read_answer_byte = answer_bytes;
+
+        memcpy(answer_data, mapped_answer_data, answer_data_bytes);
+        memcpy(answers, answer, answer_bytes);
+
+        clEnqueueUnmapMemObject(info->queue, buffers->answer, answer, 0, NULL, NULL);
+        clEnqueueUnmapMemObject(info->queue, buffers->answer_data, mapped_answer_data, 0, NULL, NULL);
+
+        if (instrument)
+            add_task_stats(info->queue, buffers, total_tasks, kernel_evt);
+        //endregion
+
+        task.write_answer_data_nanoseconds = runtime_ns(evt_writes[0]);
+        for (int i = 1; i < write_count; ++i)
+            if (i < 4 || i == 6)
+                task.write_tasks_nanoseconds += runtime_ns(evt_writes[i]);
+        task.write_dlx_nanoseconds = runtime_ns(evt_writes[4]);
+        task.write_dlx_props_nanoseconds = runtime_ns(evt_writes[5]);
+        task.kernel_nanoseconds = runtime_ns(kernel_evt);
+        task.read_answer_found_nanoseconds = runtime_ns(read_answer_found_evt);
+        task.read_answer_nanoseconds = runtime_ns(read_answer_evt);
+        add_device_timings(task);
+
+        for (int i = 0; i < write_count; ++i)
+            clReleaseEvent(evt_writes[i]);
+        clReleaseEvent(kernel_evt);
+        clReleaseEvent(read_answer_found_evt);
+        clReleaseEvent(read_answer_evt);
+        free(links16);
+    }
+
+    //region Print solutions
+    int *solution = (int *) malloc(max_N * max_N * sizeof(int));
+    for (int p = 0; p < count; ++p) {
+        struct Puzzle *puzzle = &puzzles[p];
+        const int *fields = answer_data + p * ANSWER_FIELDS;
+        unsigned int solutions = 0;
+
+        if (prepared[p] == PREPARE_SOLVED) {
+            memcpy(solution, puzzle->board, puzzle->N * puzzle->N * sizeof(int));
+            solutions = 1;
+        } else if (prepared[p] == PREPARE_SEARCH && one_by_one) {
+            struct Task alone = solve(puzzle->board, (int) (sqrt(puzzle->N) + 0.5), lws, info, buffers, solution);
+            if (alone.skipped) {
+                printf("skipped\n");
+                ++*skipped;
                 continue;
             }
-
-            tasks[count++] = c_row;
+            solutions = alone.solutions;
+        } else if (prepared[p] == PREPARE_SEARCH && fields[ANSWER_FOUND] >= 0) {
+            rebuild_solution(puzzle, fields[ANSWER_FOUND], answers + (size_t) p * max_N * max_N,
+                             fields[ANSWER_LENGTH], solution);
+            solutions = count_solutions(fields);
         }
+        print_result_line(solution, puzzle->N, solutions);
+        task.solutions += solutions;
+        if (solutions > 0)
+            ++solved;
     }
-    return count;
+    free(solution);
+    //endregion
+
+    task.found = solved;
+    task.completed = 1;
+    if (csv_file != NULL)
+        write_task_to_csv(csv_file, task);
+
+    //region Free memory
+    free(tasks);
+    free(task_puzzle);
+    free(puzzle_table);
+    free(scratch_offsets);
+    free(dlx);
+    free(dlx_props);
+    free(answer_data);
+    free(answers);
+    for (int p = 0; p < count; ++p)
+        free_puzzle(puzzles[p]);
+    //endregion
+
+    return solved;
 }
 
 cl_event
-execute_exact_cover_kernel(cl_command_queue q, cl_kernel k, size_t task_count, size_t lws, cl_int n, cl_mem d_tasks,
-                           cl_mem d_dlx, cl_mem d_dlxs, cl_mem d_dlx_props, cl_int dlx_size, cl_mem d_ans,
-                           cl_mem d_ans_found, cl_event *waitingList, int waitingListSize) {
+execute_exact_cover_kernel(cl_command_queue q, cl_kernel k, size_t task_count, size_t first_task,
+                           size_t launch_tasks, size_t lws, cl_int n, cl_mem d_tasks,
+                           cl_mem d_dlx, cl_mem d_dlxs, size_t local_copy_bytes, cl_mem d_dlx_props,
+                           cl_int dlx_size, cl_mem d_ans, cl_mem d_ans_found, cl_int task_depth, cl_uint limit,
+                           cl_int cover_words, cl_mem d_queue, cl_mem d_loads, size_t groups, cl_mem d_stats,
+                           cl_event *waitingList, int waitingListSize) {
     cl_int err;
     int i = 0;
     int N = n * n;
@@ -336,22 +1466,104 @@ execute_exact_cover_kernel(cl_command_queue q, cl_kernel k, size_t task_count, s
 //    global int *dlxs, global int *dlx_props,
 //    global int *answer, global int *answer_found,
 //    int dlx_size, int N, int task_count,
-//    local int *stacks
+//    int task_depth, uint limit, local int *stacks
+//    the lean kernel (cover_words > 0) has no dlxs and takes int cover_words, local uint *covers last,
+//    the DLX_LOCAL build (local_copy_bytes > 0) takes local dlxs of local_copy_bytes per work-item,
+//    the persistent kernels (groups > 0) take global int *queue, global int *loads before the stacks,
+//    the instrumented build (d_stats) takes global uint *task_stats last
 
     AddKernelArg(k, i++, sizeof(d_tasks), &d_tasks);
     AddKernelArg(k, i++, sizeof(d_dlx), &d_dlx);
-    AddKernelArg(k, i++, sizeof(d_dlxs), &d_dlxs);
+    if (local_copy_bytes > 0)
+        AddKernelArg(k, i++, local_copy_bytes * lws, NULL);
+    else if (cover_words == 0)
+        AddKernelArg(k, i++, sizeof(d_dlxs), &d_dlxs);
     AddKernelArg(k, i++, sizeof(d_dlx_props), &d_dlx_props);
     AddKernelArg(k, i++, sizeof(d_ans), &d_ans);
     AddKernelArg(k, i++, sizeof(d_ans_found), &d_ans_found);
     AddKernelArg(k, i++, sizeof(int), &dlx_size);
     AddKernelArg(k, i++, sizeof(int), &N);
     AddKernelArg(k, i++, sizeof(int), &task_count);
+    AddKernelArg(k, i++, sizeof(int), &task_depth);
+    AddKernelArg(k, i++, sizeof(cl_uint), &limit);
+    if (groups > 0) {
+        AddKernelArg(k, i++, sizeof(d_queue), &d_queue);
+        AddKernelArg(k, i++, sizeof(d_loads), &d_loads);
+    }
 
     AddKernelArg(k, i++, sizeof(int) * N * N * lws, NULL);
+    if (cover_words > 0) {
+        AddKernelArg(k, i++, sizeof(int), &cover_words);
+        AddKernelArg(k, i++, sizeof(cl_uint) * cover_words * lws, NULL);
+    }
+    if (d_stats != NULL)
+        AddKernelArg(k, i++, sizeof(d_stats), &d_stats);
+
+    struct MemoryString memory = memory_string(
+            (sizeof(int) * N * N + sizeof(cl_uint) * cover_words + local_copy_bytes) * lws);
+    LOG("Local Memory: %zu %s\n", memory.value, memory.unit);
+
+    // a chunk of the tasks starts at their global offset
+    size_t wgn = groups > 0 ? groups : (launch_tasks + lws - 1) / lws;
+    size_t gws = wgn * lws;
+    size_t offset = groups > 0 ? 0 : first_task;
 
-    struct MemoryString memory = memory_string(sizeof(int) * N * N * lws);
-    printf("Local Memory: %zu %s\n", memory.value, memory.unit);
+    cl_event kernel_evt;
+    err = clEnqueueNDRangeKernel(q, k, 1, offset > 0 ? &offset : NULL, &gws, &lws, waitingListSize, waitingList,
+                                 &kernel_evt);
+    ocl_check(err, "launch kernel");
+    return kernel_evt;
+}
+
+cl_event
+execute_exact_cover_multi_kernel(cl_command_queue q, cl_kernel k, size_t task_count, size_t lws, cl_int N,
+                                 cl_mem d_tasks, cl_mem d_task_puzzle, cl_mem d_puzzles, cl_mem d_scratch_offsets,
+                                 cl_mem d_dlx, cl_mem d_dlxs, size_t local_copy_bytes, cl_int copy_stride,
+                                 cl_mem d_dlx_props, cl_mem d_ans, cl_mem d_ans_data, cl_int task_depth,
+                                 cl_uint limit, cl_int cover_words, cl_mem d_stats,
+                                 cl_event *waitingList, int waitingListSize) {
+    cl_int err;
+    int i = 0;
+    int count = (int) task_count;
+
+//    global const int *tasks, global const int *task_puzzle,
+//    global const int *puzzles, global const ulong *scratch_offsets,
+//    global const int *_dlx, global int *dlxs, global const int *dlx_props,
+//    global int *answer, global int *answer_data, int N, int task_count,
+//    int task_depth, uint limit, local int *stacks
+//    the lean kernel (cover_words > 0) has neither scratch_offsets nor dlxs,
+//    and takes int cover_words, local uint *covers last,
+//    the DLX_LOCAL build (local_copy_bytes > 0) takes int copy_stride instead of scratch_offsets
+//    and local dlxs of local_copy_bytes per work-item,
+//    the instrumented build (d_stats) takes global uint *task_stats after everything
+
+    AddKernelArg(k, i++, sizeof(d_tasks), &d_tasks);
+    AddKernelArg(k, i++, sizeof(d_task_puzzle), &d_task_puzzle);
+    AddKernelArg(k, i++, sizeof(d_puzzles), &d_puzzles);
+    if (local_copy_bytes > 0)
+        AddKernelArg(k, i++, sizeof(int), &copy_stride);
+    else if (cover_words == 0)
+        AddKernelArg(k, i++, sizeof(d_scratch_offsets), &d_scratch_offsets);
+    AddKernelArg(k, i++, sizeof(d_dlx), &d_dlx);
+    if (local_copy_bytes > 0)
+        AddKernelArg(k, i++, local_copy_bytes * lws, NULL);
+    else if (cover_words == 0)
+        AddKernelArg(k, i++, sizeof(d_dlxs), &d_dlxs);
+    AddKernelArg(k, i++, sizeof(d_dlx_props), &d_dlx_props);
+    AddKernelArg(k, i++, sizeof(d_ans), &d_ans);
+    AddKernelArg(k, i++, sizeof(d_ans_data), &d_ans_data);
+    AddKernelArg(k, i++, sizeof(int), &N);
+    AddKernelArg(k, i++, sizeof(int), &count);
+    AddKernelArg(k, i++, sizeof(int), &task_depth);
+    AddKernelArg(k, i++, sizeof(cl_uint), &limit);
+
+    AddKernelArg(k, i++, sizeof(int) * N * N * lws, NULL);
+    if (cover_words > 0) {
+        AddKernelArg(k, i++, sizeof(int), &cover_words);
+        AddKernelArg(k, i++, sizeof(cl_uint) * cover_words * lws, NULL);
+    }
+    if (d_stats != NULL)
+        AddKernelArg(k, i++, sizeof(d_stats), &d_stats);
 
     size_t wgn = (task_count + lws - 1) / lws;
     size_t gws = wgn * lws;
@@ -1,11 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <windows.h>
 
 #define CL_TARGET_OPENCL_VERSION 120
 
 #include "ocl_boiler.h"
 #include "setup.h"
+#include "bitboard.h"
 
 #define PUSH(v)                                                                \
   stack[top++] = v;                                                            \
@@ -15,13 +15,75 @@
   --top;                                                                       \
   last_op = 1;
 
-int exact_cover(int *dlx, const int *dlx_props, int *answer, int dlx_size, int N);
+// search engines, selected with --engine
+#define ENGINE_DLX 0
+#define ENGINE_BITBOARD 1
+#define ENGINE_TRAIL 2 // the dancing links, undoing covers from a trail instead of walking the columns again
 
-void solve(const int *board, int n);
+int engine = ENGINE_DLX;
+
+// setup structures of the puzzle being solved, reset by solve
+struct Arena arena = {0};
+
+// --template: start every puzzle from the dancing links of the empty board of its size
+int use_template = 0;
+struct DlxTemplate dlx_template = {0};
+
+int exact_cover(int *dlx, const int *dlx_props, int *answer, int dlx_size, int N, unsigned int *solutions);
+
+unsigned int solve(const int *board, int n, int *solution);
+
+unsigned int solve_template(const int *board, int n, int *solution);
+
+int solve_batch(const char *file_name);
 
 int main(int argc, char *argv[]) {
+    // options before the mode
+    while (argc > 1) {
+        int shift = 2;
+        if (argc > 2 && strcmp(argv[1], "--engine") == 0) {
+            if (strcmp(argv[2], "bitboard") == 0) {
+                engine = ENGINE_BITBOARD;
+            } else if (strcmp(argv[2], "trail") == 0) {
+                engine = ENGINE_TRAIL;
+            } else if (strcmp(argv[2], "dlx") != 0) {
+                fprintf(stderr, "Unknown engine %s, expected dlx, trail or bitboard\n", argv[2]);
+                return 1;
+            }
+        } else if (strcmp(argv[1], "--count") == 0) {
+            solution_limit = 0;
+            shift = 1;
+        } else if (strcmp(argv[1], "--unique") == 0) {
+            solution_limit = 2;
+            shift = 1;
+        } else if (strcmp(argv[1], "--timings") == 0) {
+            report_timings = 1;
+            shift = 1;
+        } else if (strcmp(argv[1], "--template") == 0) {
+            use_template = 1;
+            shift = 1;
+        } else if (argc > 2 && strcmp(argv[1], "--limit") == 0) {
+            solution_limit = (unsigned int) strtoul(argv[2], NULL, 10);
+        } else {
+            break;
+        }
+        argv[shift] = argv[0];
+        argv += shift;
+        argc -= shift;
+    }
+
+    if (argc == 3 && strcmp(argv[1], "--batch") == 0)
+        return solve_batch(argv[2]);
+
     if (argc != 2) {
-        fprintf(stderr, "Usage: %s <sudoku>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [options] <sudoku>\n", argv[0]);
+        fprintf(stderr, "       %s [options] --batch <puzzles|->\n", argv[0]);
+        fprintf(stderr, "Options: --engine dlx|trail|bitboard, --template, --count, --limit <solutions>, --unique,\n"
+                        "         --timings\n");
+        return 1;
+    }
+    if (use_template && engine == ENGINE_BITBOARD) {
+        fprintf(stderr, "--template searches the dancing links, not available with --engine bitboard\n");
         return 1;
     }
 
@@ -29,97 +91,263 @@ int main(int argc, char *argv[]) {
     int *board = read_board(argv[1], &n);
 
     const int N = n * n;
-    const int lws = atoi(argv[2]);
+    int *solution = calloc(N * N, sizeof(int));
 
 //    printf("Sudoku loaded: %d x %d\n", N, N);
 //    print_board(board, N);
 
-    solve(board, n);
+    solve(board, n, solution);
+//    print_board(solution, N);
+    print_timings();
 
+    free(solution);
     free(board);
+    arena_free(&arena);
+    free_template(&dlx_template);
+    return 0;
+}
+
+// solve every puzzle of a stream, printing one solution line per puzzle (see print_result_line)
+int solve_batch(const char *file_name) {
+    struct BoardStream stream;
+    if (!open_board_stream(file_name, &stream))
+        return 1;
+    verbose = 0;
+
+    int n, count = 0, solved = 0;
+    int *board;
+    double start_time = wall_time_us();
+    while ((board = next_board(&stream, &n)) != NULL) {
+        int N = n * n;
+        int *solution = calloc(N * N, sizeof(int));
+
+        unsigned int solutions = solve(board, n, solution);
+        print_result_line(solution, N, solutions);
+        if (solutions > 0)
+            ++solved;
+        ++count;
+
+        free(solution);
+    }
+    double elapsed = (wall_time_us() - start_time) / 1000000;
+
+    fprintf(stderr, "%d puzzles (%d solved) in %f s: %f puzzles/s\n", count, solved, elapsed, count / elapsed);
+    print_timings();
+    close_board_stream(&stream);
+    arena_free(&arena);
+    free_template(&dlx_template);
     return 0;
 }
 
-void solve(const int *board, int n) {
+// solve a board, writing the first completed grid in solution; returns the number of solutions found,
+// at most solution_limit unless it is 0
+unsigned int solve(const int *board, int n, int *solution) {
+    if (use_template)
+        return solve_template(board, n, solution);
+
     int N = n * n;
     struct MemoryString memory;
 
-    //region Initialize dlx
-//    printf("Initializing dlx...\n");
-    int *col_ids, *row_ids, *convert_table;
-    int *dlx;
+    double phase_start = wall_time_us();
     int placed;
-    int **valid_candidates = (int **) malloc(N * N * sizeof(int *));
-
-    for (int i = 0; i < N * N; ++i) {
-        valid_candidates[i] = (int *) calloc(N, sizeof(int));
-    }
-    initial_check(board, n, valid_candidates, &placed);
+    arena_reset(&arena);
+    unsigned char *valid_candidates = initial_check(board, n, &placed, &arena);
+
+    // fill the forced cells first, easy boards need no search at all
+    int *propagated = malloc(N * N * sizeof(int));
+    memcpy(propagated, board, N * N * sizeof(int));
+    int filled = propagate(propagated, n, valid_candidates, &placed);
+    LOG("Propagation filled %d cells\n", filled);
+
+    double start_time = wall_time_us(), end_time;
+    timings.setup += start_time - phase_start;
+    // the cells filled by propagation are forced, so a board it completes has a single solution
+    unsigned int found = filled >= 0 && placed == N * N;
+
+    if (filled < 0 || found) {
+        if (found)
+            memcpy(solution, propagated, N * N * sizeof(int));
+        end_time = start_time;
+    } else if (engine == ENGINE_BITBOARD) {
+        //region Bitboard search
+        found = bitboard_cover(propagated, n, valid_candidates, solution, solution_limit);
+        end_time = wall_time_us();
+        //endregion
+    } else {
+        //region Initialize dlx
+//    printf("Initializing dlx...\n");
+        int *convert_table;
+        int *dlx;
 
-    int num_elems = convert_matrix(board, valid_candidates, placed, n, &col_ids, &row_ids, &convert_table);
-    int dlx_size = build_dancing_links(col_ids, row_ids, num_elems, &dlx);
-    int *dlx_props = dlx + 4 * dlx_size;
+        int dlx_size = build_board_links(propagated, valid_candidates, n, &dlx, &convert_table, &arena);
+        int *dlx_props = dlx + DLX_PLANES * dlx_size;
 
-    memory = memory_string(dlx_size * 4 * sizeof(int));
+        memory = memory_string(dlx_size * 4 * sizeof(int));
 
 //    printf("Number of nodes in dancing links: %d (~%llu %s)\n", dlx_size,
 //           memory.value, memory.unit);
-    //endregion
+        //endregion
+
+        //region Search
+        int *answer = malloc(N * N * sizeof(int));
+
+        // the search starts where the build ends
+        double build_start = start_time;
+        start_time = wall_time_us();
+        timings.build += start_time - build_start;
+        int answer_length = exact_cover(dlx, dlx_props, answer, dlx_size, N, &found);
+        end_time = wall_time_us();
+
+        for (int i = 0; i < answer_length; ++i)
+            answer[i] = dlx_props[answer[i] + dlx_size]; // convert to row numbers
+        // the given cells have no rows in the dancing links
+        memcpy(solution, propagated, N * N * sizeof(int));
+        convert_answer_board(answer, answer_length, convert_table, N, solution);
+
+        free(answer);
+        //endregion
+    }
 
-    //region Search
-    int *answer = malloc(N * N * sizeof(int));
+    double elapsed = end_time - start_time;
+    timings.search += elapsed;
+    LOG("Search took %f\n", elapsed);
+    if (solution_limit != 1)
+        LOG("Solutions: %u%s\n", found, limit_suffix(found));
 
+    //region Free memory
+    free(propagated);
+    //endregion
 
-    LARGE_INTEGER frequency, start_time, end_time;
-    double time_elapsed;
-    QueryPerformanceFrequency(&frequency);
-    double micro_frequency = (double) frequency.QuadPart / 1000000;
-    QueryPerformanceCounter(&start_time);
-    int answer_length = exact_cover(dlx, dlx_props, answer, dlx_size, N);
-    QueryPerformanceCounter(&end_time);
-    double elapsed = (double) (end_time.QuadPart - start_time.QuadPart) / micro_frequency;
+    return found;
+}
 
-    printf("Search took %f\n", elapsed);
+// solve with --template: cover the clues of the board on a copy of the template, without propagation
+unsigned int solve_template(const int *board, int n, int *solution) {
+    int N = n * n;
+    int *dlx, *convert_table;
+    unsigned int found = 0;
+
+    double start_time = wall_time_us();
+    arena_reset(&arena);
+    load_template(&dlx_template, n);
+    int clues = apply_template(&dlx_template, board, &dlx, &convert_table, &arena);
+    int dlx_size = dlx_template.dlx_size;
+    int *dlx_props = dlx + DLX_PLANES * dlx_size;
+    LOG("Covered %d clues\n", clues);
+
+    double end_time = wall_time_us();
+    timings.build += end_time - start_time;
+    start_time = end_time;
+
+    if (clues >= 0) {
+        int *answer = malloc(N * N * sizeof(int));
+        int answer_length = exact_cover(dlx, dlx_props, answer, dlx_size, N, &found);
+        end_time = wall_time_us();
+
+        for (int i = 0; i < answer_length; ++i)
+            answer[i] = dlx_props[answer[i] + dlx_size]; // convert to row numbers
+        memcpy(solution, board, N * N * sizeof(int));
+        convert_answer_board(answer, answer_length, convert_table, N, solution);
+        free(answer);
+    }
 
-    for (int i = 0; i < answer_length; ++i) answer[i] = dlx_props[answer[i] + dlx_size]; // convert to row numbers
-//    convert_answer_print_serial(answer, convert_table, N);
+    double elapsed = end_time - start_time;
+    timings.search += elapsed;
+    LOG("Search took %f\n", elapsed);
+    if (solution_limit != 1)
+        LOG("Solutions: %u%s\n", found, limit_suffix(found));
+    return found;
+}
 
-    free(answer);
-    //endregion
+//region Trail
+// The trail engine logs what a cover detaches: -id for a column indicator, then every node unlinked
+// from its column. Undoing a row replays its part of the log backwards, so the links are restored
+// in the exact reverse order of the writes without walking the covered columns (and their rows
+// that were never unlinked) a second time. A node is in the log at most once and a column
+// indicator too, so 2 * dlx_size entries always suffice.
+
+// remove_column logging to trail from length on, returns the new length
+int remove_column_trail(int id, int *dlx, const int *col, int dlx_size, int *trail, int length) {
+    int *up, *down, *left, *right, *size;
+    UNLOAD_NO_PROPS(dlx, dlx_size);
+
+    RIGHT(LEFT(id)) = RIGHT(id);
+    LEFT(RIGHT(id)) = LEFT(id);
+    trail[length++] = -id;
+
+    for (int row_id = DOWN(id); row_id != id; row_id = DOWN(row_id)) {
+        for (int elem = RIGHT(row_id); elem != row_id; elem = RIGHT(elem)) {
+            DOWN(UP(elem)) = DOWN(elem);
+            UP(DOWN(elem)) = UP(elem);
+            --size[col[elem]];
+            trail[length++] = elem;
+        }
+    }
+    return length;
+}
 
-    //region Free memory
-    free(dlx);
-    free(convert_table);
-    free(col_ids);
-    free(row_ids);
-    for (int i = 0; i < N * N; ++i) free(valid_candidates[i]);
-    free(valid_candidates);
-    //endregion
+// relink the count entries of trail, newest first. An unlinked node still points to the neighbours
+// it had, which are back in place by the time it is relinked.
+void undo_trail(int *dlx, const int *col, int dlx_size, const int *trail, int count) {
+    int *up, *down, *left, *right, *size;
+    UNLOAD_NO_PROPS(dlx, dlx_size);
+
+    for (int i = count - 1; i >= 0; --i) {
+        int node = trail[i];
+        if (node < 0) {
+            RIGHT(LEFT(-node)) = -node;
+            LEFT(RIGHT(-node)) = -node;
+        } else {
+            DOWN(UP(node)) = node;
+            UP(DOWN(node)) = node;
+            ++size[col[node]];
+        }
+    }
 }
+//endregion
 
-int exact_cover(int *dlx, const int *dlx_props, int *answer, int dlx_size, int N) {
-    int *col = dlx_props;
+// Search the covers of the dancing links, stopping after solution_limit of them (0: all).
+// The first cover is copied to answer; returns its length and the number of covers in *solutions.
+// With the trail engine, backtracking replays the trail instead of calling restore_column.
+int exact_cover(int *dlx, const int *dlx_props, int *answer, int dlx_size, int N, unsigned int *solutions) {
+    const int *col = dlx_props;
 
-    int *up, *down, *left, *right;
+    int *down = LINK_PLANE(dlx, 1, dlx_size);
+    int *left = LINK_PLANE(dlx, 2, dlx_size);
+    int *right = LINK_PLANE(dlx, 3, dlx_size);
     int *stack = malloc(N * N * sizeof(int));
-    UNLOAD_NO_PROPS(dlx, dlx_size)
 
-    int top = 0;
+    // trail length before each row of the stack was covered
+    int *trail = NULL, *marks = NULL, trail_length = 0;
+    if (engine == ENGINE_TRAIL) {
+        trail = malloc(2 * dlx_size * sizeof(int));
+        marks = malloc(N * N * sizeof(int));
+    }
+
+    int top = 0, length = 0;
     int last_op = 0; // 0 - push stack, 1 - pop stack
     int c_col, c_row;
+    *solutions = 0;
     while (1) {
         if (last_op == 0) {
-            if (right[0] == 0) {
-                memcpy(answer, stack, top * sizeof(int));
-                return top;
+            if (RIGHT(0) == 0) {
+                if (*solutions == 0) {
+                    memcpy(answer, stack, top * sizeof(int));
+                    length = top;
+                }
+                if (++*solutions == solution_limit || top == 0)
+                    break;
+                // keep searching from the last row
+                POP()
+                continue;
             }
 
-            c_col = right[0];
-            c_row = down[c_col];
+            c_col = choose_column(dlx, dlx_size);
+            c_row = DOWN(c_col);
             if (c_row == c_col) {
                 // this column has not been covered
                 if (top == 0)
-                    return 0;
+                    break;
                 POP()
                 continue;
             }
@@ -127,25 +355,43 @@ int exact_cover(int *dlx, const int *dlx_props, int *answer, int dlx_size, int N
             // read stack top and restore
 
             c_row = stack[top];
-            for (int elem = right[c_row]; elem != c_row; elem = right[elem])
-                restore_column(col[elem], dlx, dlx_size);
-            restore_column(col[c_row], dlx, dlx_size);
-            c_row = down[c_row]; // go to next row
+            c_col = col[c_row];
+            if (trail != NULL) {
+                undo_trail(dlx, col, dlx_size, trail + marks[top], trail_length - marks[top]);
+                trail_length = marks[top];
+            } else {
+                for (int elem = LEFT(c_row); elem != c_row; elem = LEFT(elem))
+                    restore_column(col[elem], dlx, col, dlx_size);
+                restore_column(c_col, dlx, col, dlx_size);
+            }
+            c_row = DOWN(c_row); // go to next row
 
             // this column has finished iteration
-            if (c_row == right[0]) {
+            if (c_row == c_col) {
                 // pop stack
                 if (top == 0)
-                    return 0;
+                    break;
                 POP()
                 continue;
             }
         }
 
-        remove_column(col[c_row], dlx, dlx_size);
-        for (int elem = right[c_row]; elem != c_row; elem = right[elem])
-            remove_column(col[elem], dlx, dlx_size);
+        if (trail != NULL) {
+            marks[top] = trail_length;
+            trail_length = remove_column_trail(col[c_row], dlx, col, dlx_size, trail, trail_length);
+            for (int elem = RIGHT(c_row); elem != c_row; elem = RIGHT(elem))
+                trail_length = remove_column_trail(col[elem], dlx, col, dlx_size, trail, trail_length);
+        } else {
+            remove_column(col[c_row], dlx, col, dlx_size);
+            for (int elem = RIGHT(c_row); elem != c_row; elem = RIGHT(elem))
+                remove_column(col[elem], dlx, col, dlx_size);
+        }
 
         PUSH(c_row)
     }
-}
\ No newline at end of file
+
+    free(stack);
+    free(trail);
+    free(marks);
+    return length;
+}
@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define CL_TARGET_OPENCL_VERSION 120
+
+#include "ocl_boiler.h"
+#include "setup.h"
+#include "tasks.h"
+
+#define PUSH(v)                                                                \
+  stack[top++] = v;                                                            \
+  last_op = 0;
+
+#define POP()                                                                  \
+  --top;                                                                       \
+  last_op = 1;
+
+// Every task is a prefix of rows to cover before searching: slot[0] holds
+// the prefix length, slot[1..] the rows. A deque owns a ring of such slots.
+struct Deque {
+    pthread_mutex_t lock;
+    int *slots;
+    int stride;
+    int capacity;
+    int head;
+    atomic_int count;
+};
+
+struct Shared {
+    const int *dlx;
+    const int *col;
+    int dlx_size;
+    int N;
+    int workers;
+    struct Deque *deques;
+    atomic_int answer_found;
+    int *answer;
+    int answer_length;
+    atomic_int pending; // tasks queued or running
+    atomic_int idle;    // workers looking for a task
+};
+
+struct Worker {
+    int id;
+    struct Shared *shared;
+    int *dlx;
+    int *stack;
+    int *task;
+    int executed;
+    int stolen;
+    int donated;
+};
+
+void *worker_main(void *arg);
+
+int search_task(struct Worker *w);
+
+void solve(const int *board, int n, int workers);
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--timings") == 0) {
+        report_timings = 1;
+        argv[1] = argv[0];
+        ++argv;
+        --argc;
+    }
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s [--timings] <sudoku> [threads]\n", argv[0]);
+        return 1;
+    }
+
+    int n;
+    int *board = read_board(argv[1], &n);
+
+    const int N = n * n;
+    int workers = argc == 3 ? atoi(argv[2]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < 1)
+        workers = 1;
+
+    printf("Sudoku loaded: %d x %d\n", N, N);
+    print_board(board, N);
+
+    solve(board, n, workers);
+    print_timings();
+
+    free(board);
+    return 0;
+}
+
+//region Work-stealing deque
+void deque_init(struct Deque *q, int stride, int capacity) {
+    pthread_mutex_init(&q->lock, NULL);
+    q->slots = malloc((size_t) capacity * stride * sizeof(int));
+    q->stride = stride;
+    q->capacity = capacity;
+    q->head = 0;
+    atomic_init(&q->count, 0);
+}
+
+void deque_free(struct Deque *q) {
+    pthread_mutex_destroy(&q->lock);
+    free(q->slots);
+}
+
+// owner side: push a task at the bottom
+void deque_push(struct Deque *q, const int *prefix, int length) {
+    pthread_mutex_lock(&q->lock);
+    int count = atomic_load_explicit(&q->count, memory_order_relaxed);
+    if (count == q->capacity) {
+        // grow and unwrap the ring
+        int *slots = malloc((size_t) q->capacity * 2 * q->stride * sizeof(int));
+        for (int i = 0; i < count; ++i)
+            memcpy(slots + i * q->stride, q->slots + ((q->head + i) % q->capacity) * q->stride,
+                   q->stride * sizeof(int));
+        free(q->slots);
+        q->slots = slots;
+        q->head = 0;
+        q->capacity *= 2;
+    }
+    int *slot = q->slots + ((q->head + count) % q->capacity) * q->stride;
+    slot[0] = length;
+    memcpy(slot + 1, prefix, length * sizeof(int));
+    atomic_store_explicit(&q->count, count + 1, memory_order_relaxed);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// owner side: pop the most recent (deepest, smallest) task from the bottom
+int deque_pop(struct Deque *q, int *task) {
+    if (atomic_load_explicit(&q->count, memory_order_relaxed) == 0)
+        return 0;
+    pthread_mutex_lock(&q->lock);
+    int count = atomic_load_explicit(&q->count, memory_order_relaxed);
+    if (count == 0) {
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+    }
+    int *slot = q->slots + ((q->head + count - 1) % q->capacity) * q->stride;
+    memcpy(task, slot, (slot[0] + 1) * sizeof(int));
+    atomic_store_explicit(&q->count, count - 1, memory_order_relaxed);
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+
+// thief side: take the oldest (shallowest, largest) task from the top
+int deque_steal(struct Deque *q, int *task) {
+    if (atomic_load_explicit(&q->count, memory_order_relaxed) == 0)
+        return 0;
+    if (pthread_mutex_trylock(&q->lock) != 0)
+        return 0;
+    int count = atomic_load_explicit(&q->count, memory_order_relaxed);
+    if (count == 0) {
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+    }
+    int *slot = q->slots + q->head * q->stride;
+    memcpy(task, slot, (slot[0] + 1) * sizeof(int));
+    q->head = (q->head + 1) % q->capacity;
+    atomic_store_explicit(&q->count, count - 1, memory_order_relaxed);
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+//endregion
+
+void solve(const int *board, int n, int workers) {
+    int N = n * n;
+    struct MemoryString memory;
+
+    //region Initialize dlx
+    printf("Initializing dlx...\n");
+    double phase_start = wall_time_us();
+    int *convert_table;
+    int *dlx;
+    int placed;
+    struct Arena arena = {0}; // setup structures, the workers only use their own copies
+    unsigned char *valid_candidates = initial_check(board, n, &placed, &arena);
+
+    // fill the forced cells first, easy boards need no search at all
+    int *propagated = malloc(N * N * sizeof(int));
+    memcpy(propagated, board, N * N * sizeof(int));
+    int filled = propagate(propagated, n, valid_candidates, &placed);
+    printf("Propagation filled %d cells\n", filled);
+    double phase_end = wall_time_us();
+    timings.setup += phase_end - phase_start;
+    phase_start = phase_end;
+    if (filled < 0 || placed == N * N) {
+        if (filled < 0)
+            printf("No answer found.\n");
+        else
+            print_board(propagated, N);
+        free(propagated);
+        arena_free(&arena);
+        return;
+    }
+
+    int dlx_size = build_board_links(propagated, valid_candidates, n, &dlx, &convert_table, &arena);
+    int *dlx_props = dlx + DLX_PLANES * dlx_size;
+    int *row = dlx_props + dlx_size;
+    phase_end = wall_time_us();
+    timings.build += phase_end - phase_start;
+    phase_start = phase_end;
+
+    memory = memory_string(dlx_size * DLX_PLANES * sizeof(int));
+
+    printf("Number of nodes in dancing links: %d (~%zu %s)\n", dlx_size,
+           memory.value, memory.unit);
+    //endregion
+
+    //region Generate tasks
+    // one task per node below a column indicator, the 4 columns of every empty cell
+    int estimated_tasks_count = dlx_size - 4 * (N * N - placed) - 1;
+    int *tasks = (int *) malloc(estimated_tasks_count * sizeof(int));
+
+    int c_tasks_count = permutate_tasks(dlx, dlx_size, tasks, estimated_tasks_count);
+    if (c_tasks_count > estimated_tasks_count) {
+        fprintf(stderr, "Too many tasks generated: %d > %d\n", c_tasks_count, estimated_tasks_count);
+        free(tasks);
+        free(propagated);
+        arena_free(&arena);
+        return;
+    }
+    timings.tasks += wall_time_us() - phase_start;
+
+    memory = memory_string(dlx_size * DLX_PLANES * workers * sizeof(int));
+    printf("%d tasks generated for %d threads (dlx copies taking ~%zu %s of memory).\n", c_tasks_count, workers,
+           memory.value, memory.unit);
+    //endregion
+
+    //region Threaded search
+    struct Shared shared;
+    shared.dlx = dlx;
+    shared.col = dlx_props;
+    shared.dlx_size = dlx_size;
+    shared.N = N;
+    shared.workers = workers;
+    shared.deques = malloc(workers * sizeof(struct Deque));
+    shared.answer = malloc(N * N * sizeof(int));
+    shared.answer_length = 0;
+    atomic_init(&shared.answer_found, 0);
+    atomic_init(&shared.pending, c_tasks_count);
+    atomic_init(&shared.idle, 0);
+
+    // deal the top level tasks round robin, the deques balance the rest;
+    // they are pushed backwards so that owners pop them in generation order
+    for (int i = 0; i < workers; ++i)
+        deque_init(&shared.deques[i], N * N + 1, c_tasks_count / workers + 1);
+    for (int i = c_tasks_count - 1; i >= 0; --i)
+        deque_push(&shared.deques[i % workers], &tasks[i], 1);
+
+    struct Worker *pool = calloc(workers, sizeof(struct Worker));
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+
+    printf("Starting threaded search...\n");
+    double start_time = wall_time_us();
+    for (int i = 0; i < workers; ++i) {
+        pool[i].id = i;
+        pool[i].shared = &shared;
+        pool[i].dlx = malloc(dlx_size * DLX_PLANES * sizeof(int));
+        pool[i].stack = malloc(N * N * sizeof(int));
+        pool[i].task = malloc((N * N + 1) * sizeof(int));
+        pthread_create(&threads[i], NULL, worker_main, &pool[i]);
+    }
+    for (int i = 0; i < workers; ++i)
+        pthread_join(threads[i], NULL);
+    double elapsed = wall_time_us() - start_time;
+    timings.search += elapsed;
+
+    printf("Search took %f\n", elapsed);
+    for (int i = 0; i < workers; ++i) {
+        printf("Thread %d: %d tasks executed, %d stolen, %d donated\n",
+               i, pool[i].executed, pool[i].stolen, pool[i].donated);
+    }
+
+    if (atomic_load(&shared.answer_found)) {
+        int *answer = shared.answer;
+        for (int i = 0; i < shared.answer_length; ++i)
+            answer[i] = row[answer[i]]; // convert to row numbers
+        convert_answer_print_serial(propagated, answer, shared.answer_length, convert_table, N);
+    } else {
+        printf("No answer found.\n");
+    }
+    //endregion
+
+    //region Free memory
+    for (int i = 0; i < workers; ++i) {
+        free(pool[i].dlx);
+        free(pool[i].stack);
+        free(pool[i].task);
+        deque_free(&shared.deques[i]);
+    }
+    free(pool);
+    free(threads);
+    free(shared.deques);
+    free(shared.answer);
+
+    free(tasks);
+    free(propagated);
+    arena_free(&arena);
+    //endregion
+}
+
+void *worker_main(void *arg) {
+    struct Worker *w = arg;
+    struct Shared *s = w->shared;
+    int idle = 0;
+
+    while (!atomic_load_explicit(&s->answer_found, memory_order_relaxed)) {
+        int found = deque_pop(&s->deques[w->id], w->task);
+        for (int i = 1; !found && i < s->workers; ++i) {
+            found = deque_steal(&s->deques[(w->id + i) % s->workers], w->task);
+            w->stolen += found;
+        }
+
+        if (!found) {
+            if (atomic_load(&s->pending) == 0)
+                break;
+            if (!idle) {
+                idle = 1;
+                atomic_fetch_add(&s->idle, 1);
+            }
+            sched_yield();
+            continue;
+        }
+        if (idle) {
+            idle = 0;
+            atomic_fetch_sub(&s->idle, 1);
+        }
+
+        ++w->executed;
+        int answer_length = search_task(w);
+        if (answer_length > 0) {
+            int expected = 0;
+            if (atomic_compare_exchange_strong(&s->answer_found, &expected, w->id + 1)) {
+                // the stack holds the task prefix followed by the rows found
+                s->answer_length = answer_length;
+                memcpy(s->answer, w->stack, answer_length * sizeof(int));
+            }
+        }
+        atomic_fetch_sub(&s->pending, 1);
+    }
+
+    if (idle)
+        atomic_fetch_sub(&s->idle, 1);
+    return NULL;
+}
+
+// Hand the untried rows of the shallowest owned level over to the own deque,
+// so that idle threads can steal them; that level then becomes part of the prefix.
+void donate(struct Worker *w, int *base, int top) {
+    struct Shared *s = w->shared;
+    int *down = LINK_PLANE(w->dlx, 1, s->dlx_size);
+    int *stack = w->stack;
+
+    // levels without siblings are as good as part of the prefix
+    while (*base < top && DOWN(stack[*base]) == s->col[stack[*base]])
+        ++*base;
+    if (*base >= top)
+        return;
+
+    int level = *base;
+    int c_col = s->col[stack[level]];
+    for (int c_row = DOWN(stack[level]); c_row != c_col; c_row = DOWN(c_row)) {
+        int saved = stack[level];
+        stack[level] = c_row;
+        atomic_fetch_add(&s->pending, 1);
+        deque_push(&s->deques[w->id], stack, level + 1);
+        stack[level] = saved;
+        ++w->donated;
+    }
+    ++*base;
+}
+
+// Restore the worker copy of the dlx, cover the task prefix and search the
+// remaining subtree, returning the length of the exact cover found or 0.
+int search_task(struct Worker *w) {
+    struct Shared *s = w->shared;
+    int dlx_size = s->dlx_size;
+    int *dlx = w->dlx;
+    const int *col = s->col;
+    int *stack = w->stack;
+
+    int *down = LINK_PLANE(dlx, 1, dlx_size);
+    int *left = LINK_PLANE(dlx, 2, dlx_size);
+    int *right = LINK_PLANE(dlx, 3, dlx_size);
+
+    memcpy(dlx, s->dlx, dlx_size * DLX_PLANES * sizeof(int));
+
+    int top = 0;
+    int last_op = 0; // 0 - push stack, 1 - pop stack
+    int c_col, c_row;
+
+    for (int i = 1; i <= w->task[0]; ++i) {
+        c_row = w->task[i];
+        remove_column(col[c_row], dlx, col, dlx_size);
+        for (int elem = RIGHT(c_row); elem != c_row; elem = RIGHT(elem))
+            remove_column(col[elem], dlx, col, dlx_size);
+        stack[top++] = c_row;
+    }
+    int base = top; // levels below base belong to the task prefix
+
+    while (!atomic_load_explicit(&s->answer_found, memory_order_relaxed)) {
+        if (atomic_load_explicit(&s->idle, memory_order_relaxed) > 0 &&
+            atomic_load_explicit(&s->deques[w->id].count, memory_order_relaxed) == 0)
+            donate(w, &base, top);
+
+        if (last_op == 0) {
+            if (RIGHT(0) == 0)
+                return top;
+
+            c_col = choose_column(dlx, dlx_size);
+            c_row = DOWN(c_col);
+            if (c_row == c_col) {
+                // this column has not been covered
+                if (top == base)
+                    return 0;
+                POP()
+                continue;
+            }
+        } else {
+            // read stack top and restore
+
+            c_row = stack[top];
+            c_col = col[c_row];
+            for (int elem = LEFT(c_row); elem != c_row; elem = LEFT(elem))
+                restore_column(col[elem], dlx, col, dlx_size);
+            restore_column(c_col, dlx, col, dlx_size);
+            c_row = DOWN(c_row); // go to next row
+
+            // this column has finished iteration
+            if (c_row == c_col) {
+                // pop stack
+                if (top == base)
+                    return 0;
+                POP()
+                continue;
+            }
+        }
+
+        remove_column(col[c_row], dlx, col, dlx_size);
+        for (int elem = RIGHT(c_row); elem != c_row; elem = RIGHT(elem))
+            remove_column(col[elem], dlx, col, dlx_size);
+
+        PUSH(c_row)
+    }
+    return 0;
+}
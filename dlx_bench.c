@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+
+#define CL_TARGET_OPENCL_VERSION 120
+
+#include "ocl_boiler.h"
+#include "setup.h"
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+// Runs every engine over the boards of inputs/ (one board per file) and over the corpora given on
+// the command line (--batch streams), reading back the "timings;..." line each run prints with
+// --timings. Every engine / input pair reports the min, median and p99 of the process wall time
+// and of each phase of struct Timings.
+
+struct Engine {
+    const char *name;
+    const char *binary;
+    const char *options;
+    int tile;  // takes the tile size after the input
+    int batch; // understands --batch
+};
+
+struct Engine engines[] = {
+        {"serial",          "dlx_serial",       "",                    0, 1},
+        {"trail",           "dlx_serial",       "--engine trail",      0, 1},
+        {"bitboard",        "dlx_serial",       "--engine bitboard",   0, 1},
+        {"template",        "dlx_serial",       "--template",          0, 1},
+        {"threads",         "dlx_threads",      "",                    0, 0},
+        {"parallel",        "dlx_parallel",     "",                    1, 1},
+        {"lean",            "dlx_parallel",     "--lean",              1, 1},
+        {"lean-persistent", "dlx_parallel",     "--lean --persistent", 1, 1},
+        {"global-dlx",      "dlx_parallel",     "--global-dlx",        1, 1},
+        {"gpu-template",    "dlx_parallel",     "--template",          1, 1},
+        // array-of-structs node layout, built with DLX_AOS
+        {"serial-aos",      "dlx_serial_aos",   "",                    0, 1},
+        {"parallel-aos",    "dlx_parallel_aos", "",                    1, 1},
+        {"lean-aos",        "dlx_parallel_aos", "--lean",              1, 1},
+};
+#define ENGINES (int) (sizeof(engines) / sizeof(engines[0]))
+
+// wall time of the process, then the fields of struct Timings
+#define PHASES 6
+const char *phase_names[PHASES] = {"total", "setup", "build", "tasks", "transfer", "search"};
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+// Run an engine once on an input, filling times with PHASES microseconds. Returns 0 when the
+// engine failed or printed no timings.
+int run_engine(const struct Engine *engine, const char *bin_dir, const char *input, int batch, int lws,
+               double *times) {
+    char command[4096];
+    char tile[16] = "";
+    if (engine->tile)
+        snprintf(tile, sizeof(tile), " %d", lws);
+    snprintf(command, sizeof(command), "\"%s/%s\" --timings %s %s \"%s\"%s 2>&1", bin_dir, engine->binary,
+             engine->options, batch ? "--batch" : "", input, tile);
+
+    double start_time = wall_time_us();
+    FILE *out = popen(command, "r");
+    if (out == NULL)
+        return 0;
+
+    char line[4096];
+    int found = 0;
+    while (fgets(line, sizeof(line), out) != NULL) {
+        if (strncmp(line, "timings;", 8) == 0)
+            found = sscanf(line + 8, "%lf;%lf;%lf;%lf;%lf", &times[1], &times[2], &times[3], &times[4],
+                           &times[5]) == 5;
+    }
+    int status = pclose(out);
+    times[0] = wall_time_us() - start_time;
+    return found && status == 0;
+}
+
+// print min / median / p99 of every phase of reps runs (times holds PHASES values per run), in ms
+void report(const char *engine, const char *input, double *times, int reps) {
+    double *values = malloc(reps * sizeof(double));
+
+    printf("%s on %s (%d runs, ms)\n", engine, input, reps);
+    for (int phase = 0; phase < PHASES; ++phase) {
+        for (int r = 0; r < reps; ++r)
+            values[r] = times[r * PHASES + phase] / 1000;
+        qsort(values, reps, sizeof(double), compare_doubles);
+
+        int p99 = (int) (0.99 * reps + 0.999999) - 1;
+        printf("  %-9s %12.3f %12.3f %12.3f\n", phase_names[phase], values[0], values[reps / 2], values[p99]);
+    }
+    free(values);
+}
+
+void bench(const struct Engine *engine, const char *bin_dir, const char *input, int batch, int lws, int reps) {
+    double *times = malloc((size_t) reps * PHASES * sizeof(double));
+
+    for (int r = 0; r < reps; ++r) {
+        if (!run_engine(engine, bin_dir, input, batch, lws, times + r * PHASES)) {
+            printf("%s on %s: failed\n", engine->name, input);
+            free(times);
+            return;
+        }
+    }
+    report(engine->name, input, times, reps);
+    free(times);
+}
+
+int main(int argc, char *argv[]) {
+    int reps = 5, lws = 32;
+    const char *inputs_dir = "inputs";
+    const char *only = NULL;
+
+    // the engines are next to dlx_bench unless --bin says otherwise
+    char bin_dir[1024] = ".";
+    const char *slash = strrchr(argv[0], '/');
+    if (slash == NULL)
+        slash = strrchr(argv[0], '\\');
+    if (slash != NULL)
+        snprintf(bin_dir, sizeof(bin_dir), "%.*s", (int) (slash - argv[0]), argv[0]);
+
+    int first_corpus = 1;
+    while (first_corpus + 1 < argc && strncmp(argv[first_corpus], "--", 2) == 0) {
+        const char *option = argv[first_corpus], *value = argv[first_corpus + 1];
+        if (strcmp(option, "--reps") == 0) {
+            reps = atoi(value);
+        } else if (strcmp(option, "--tile") == 0) {
+            lws = atoi(value);
+        } else if (strcmp(option, "--bin") == 0) {
+            snprintf(bin_dir, sizeof(bin_dir), "%s", value);
+        } else if (strcmp(option, "--inputs") == 0) {
+            inputs_dir = value;
+        } else if (strcmp(option, "--engine") == 0) {
+            only = value;
+        } else {
+            break;
+        }
+        first_corpus += 2;
+    }
+    if (reps < 1 || (first_corpus < argc && strncmp(argv[first_corpus], "--", 2) == 0)) {
+        fprintf(stderr, "Usage: %s [--reps <n>] [--tile <lws>] [--bin <dir>] [--inputs <dir>] [--engine <name>] "
+                        "[corpus...]\n", argv[0]);
+        fprintf(stderr, "Engines:");
+        for (int e = 0; e < ENGINES; ++e)
+            fprintf(stderr, " %s", engines[e].name);
+        fprintf(stderr, "\n");
+        return 1;
+    }
+
+    //region Collect inputs
+    int input_count = 0, capacity = 16;
+    char **inputs = malloc(capacity * sizeof(char *));
+    DIR *dir = opendir(inputs_dir);
+    if (dir == NULL) {
+        fprintf(stderr, "Cannot open %s\n", inputs_dir);
+    } else {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            size_t length = strlen(entry->d_name);
+            if (length < 4 || strcmp(entry->d_name + length - 4, ".txt") != 0)
+                continue;
+            if (input_count == capacity) {
+                capacity *= 2;
+                inputs = realloc(inputs, capacity * sizeof(char *));
+            }
+            inputs[input_count] = malloc(strlen(inputs_dir) + length + 2);
+            sprintf(inputs[input_count++], "%s/%s", inputs_dir, entry->d_name);
+        }
+        closedir(dir);
+    }
+    qsort(inputs, input_count, sizeof(char *), compare_strings);
+    //endregion
+
+    for (int e = 0; e < ENGINES; ++e) {
+        if (only != NULL && strcmp(only, engines[e].name) != 0)
+            continue;
+        for (int i = 0; i < input_count; ++i)
+            bench(&engines[e], bin_dir, inputs[i], 0, lws, reps);
+        for (int c = first_corpus; c < argc; ++c) {
+            if (engines[e].batch)
+                bench(&engines[e], bin_dir, argv[c], 1, lws, reps);
+        }
+    }
+
+    for (int i = 0; i < input_count; ++i)
+        free(inputs[i]);
+    free(inputs);
+    return 0;
+}
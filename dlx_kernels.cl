@@ -1,119 +1,230 @@
+// up, down, left, right and the column sizes
+#define DLX_PLANES 5
+
+// -DDLX_LINK16: links and sizes are 16-bit, which the host picks whenever every node index of
+// the boards fits, halving the dlx copies of the work-items. The props stay int.
+#ifdef DLX_LINK16
+typedef ushort link_t;
+#else
+typedef int link_t;
+#endif
+
+// link layout of the host (setup.h): planes of dlx_size ints, or {up, down, left, right}
+// records with -DDLX_AOS
+#ifdef DLX_AOS
+#define LINK_STRIDE 4
+#define LINK_PLANE(dlx, k, dlx_size) ((dlx) + (k))
+#else
+#define LINK_STRIDE 1
+#define LINK_PLANE(dlx, k, dlx_size) ((dlx) + (dlx_size) * (k))
+#endif
+#define UP(x) up[(x) * LINK_STRIDE]
+#define DOWN(x) down[(x) * LINK_STRIDE]
+#define LEFT(x) left[(x) * LINK_STRIDE]
+#define RIGHT(x) right[(x) * LINK_STRIDE]
+
 #define UNLOAD(dlx, dlx_size)                                                  \
-  up = (dlx);                                                                  \
-  down = (dlx) + dlx_size;                                                     \
-  left = (dlx) + dlx_size * 2;                                                 \
-  right = (dlx) + dlx_size * 3;
+  up = LINK_PLANE(dlx, 0, dlx_size);                                           \
+  down = LINK_PLANE(dlx, 1, dlx_size);                                         \
+  left = LINK_PLANE(dlx, 2, dlx_size);                                         \
+  right = LINK_PLANE(dlx, 3, dlx_size);                                        \
+  size = (dlx) + dlx_size * 4;
+
+// -DDLX_LOCAL: the dlx copies searched by the work-items live in local memory, dlxs being a local
+// buffer of one copy per work-item of the group, which the host picks whenever they fit in the
+// local memory of the device. Without it dlxs is a global buffer of one copy per task (or per
+// work-item of the persistent kernels).
+// The multi kernel then takes the stride of the copies (those of the largest board of the launch)
+// instead of the scratch_offsets of the boards.
+#ifdef DLX_LOCAL
+#define DLX_SPACE __local
+#define COPY_ID(g_id, l_id) (l_id)
+#define SCRATCH_PARAM int copy_stride
+#else
+#define DLX_SPACE __global
+#define COPY_ID(g_id, l_id) (g_id)
+#define SCRATCH_PARAM global const ulong *scratch_offsets
+#endif
+
+// -DDLX_N=<N> specializes the kernels on N x N boards, so that the strides of the stacks and answers
+// (N * N rows) are constants. Without it they come from the N argument.
+#ifdef DLX_N
+#define BOARD_CELLS (DLX_N * DLX_N)
+#else
+#define BOARD_CELLS (N * N)
+#endif
+
+// fields of the per-task counters of an instrumented build (-DDLX_INSTRUMENT)
+#define STAT_PUSHES 0
+#define STAT_POPS 1
+#define STAT_REMOVES 2  // remove_column_d calls, rows covered by the lean kernels
+#define STAT_RESTORES 3 // restore_column_d calls, rows uncovered by the lean kernels
+#define STAT_NODES 4    // nodes whose links were read or written
+#define STAT_FIELDS 5
+
+// The instrumented kernels take a global uint *task_stats last, STAT_FIELDS counters per task
+// (the tasks of a multi launch are indexed over the whole group), and thread the counters of
+// the current task through the search as stats. Without DLX_INSTRUMENT all of it compiles away.
+#ifdef DLX_INSTRUMENT
+#define STATS_KERNEL_PARAM , global uint *task_stats
+#define STATS_PARAM , __global uint *stats
+#define STATS_ARG , stats
+#define TASK_STATS(id) __global uint *stats = task_stats + (size_t)(id)*STAT_FIELDS;
+#define COUNT(field, n) stats[field] += (n);
+#else
+#define STATS_KERNEL_PARAM
+#define STATS_PARAM
+#define STATS_ARG
+#define TASK_STATS(id)
+#define COUNT(field, n)
+#endif
 
 #define PUSH(v)                                                                \
   stack[top++] = v;                                                            \
-  last_op = 0;
+  last_op = 0;                                                                 \
+  COUNT(STAT_PUSHES, 1)
 
 #define POP()                                                                  \
   --top;                                                                       \
-  last_op = 1;
+  last_op = 1;                                                                 \
+  COUNT(STAT_POPS, 1)
+
+// fields of the answer_data of a board
+#define ANSWER_FOUND 0     // task whose answer is in answer, -1 until there is one
+#define ANSWER_LENGTH 1    // rows of that answer after the task prefix
+#define ANSWER_SOLUTIONS 2 // covers counted by the work-items, added when they finish
+#define ANSWER_COUNTED 3   // running count of the covers, only kept when limit > 1
+#define ANSWER_FIELDS 4
+
+// Whether the search of a board is over: looking for one solution (limit 1) once an answer
+// has been claimed, looking for more once limit covers have been counted (never for limit 0).
+int search_over_d(__global const int *answer_found, uint limit) {
+  if (limit == 1)
+    return answer_found[ANSWER_FOUND] != -1;
+  return limit > 1 && (uint)answer_found[ANSWER_COUNTED] >= limit;
+}
 
-void remove_column_d(int id, __global int *dlx, int dlx_size) {
-  __global int *up, *down, *left, *right;
+// add the covers counted by a work-item to the total of its board
+void add_solutions_d(__global int *answer_found, uint found) {
+  if (found > 0)
+    atomic_add(answer_found + ANSWER_SOLUTIONS, (int)found);
+}
+
+void remove_column_d(int id, DLX_SPACE link_t *dlx, __global const int *col,
+                     int dlx_size STATS_PARAM) {
+  DLX_SPACE link_t *up, *down, *left, *right, *size;
   UNLOAD(dlx, dlx_size);
+  COUNT(STAT_REMOVES, 1)
+  COUNT(STAT_NODES, 1)
 
   // first detach the column indicator
-  right[left[id]] = right[id];
-  left[right[id]] = left[id];
+  RIGHT(LEFT(id)) = RIGHT(id);
+  LEFT(RIGHT(id)) = LEFT(id);
 
   // find every row of this column
-  for (int c_row = down[id]; c_row != id; c_row = down[c_row]) {
+  for (int c_row = DOWN(id); c_row != id; c_row = DOWN(c_row)) {
     // find every element in that row
-    for (int elem = right[c_row]; elem != c_row; elem = right[elem]) {
+    COUNT(STAT_NODES, 1)
+    for (int elem = RIGHT(c_row); elem != c_row; elem = RIGHT(elem)) {
+      COUNT(STAT_NODES, 1)
       // detach that element
-      down[up[elem]] = down[elem];
-      up[down[elem]] = up[elem];
+      DOWN(UP(elem)) = DOWN(elem);
+      UP(DOWN(elem)) = UP(elem);
+      --size[col[elem]];
     }
   }
 }
 
-void restore_column_d(int id, __global int *dlx, int dlx_size) {
-  __global int *up, *down, *left, *right;
+void restore_column_d(int id, DLX_SPACE link_t *dlx, __global const int *col,
+                      int dlx_size STATS_PARAM) {
+  DLX_SPACE link_t *up, *down, *left, *right, *size;
   UNLOAD(dlx, dlx_size);
+  COUNT(STAT_RESTORES, 1)
+  COUNT(STAT_NODES, 1)
 
   // first detach the column indicator
-  right[left[id]] = id;
-  left[right[id]] = id;
+  RIGHT(LEFT(id)) = id;
+  LEFT(RIGHT(id)) = id;
 
-  // find every row of this column
-  for (int c_row = down[id]; c_row != id; c_row = down[c_row]) {
+  // find every row of this column, in the reverse order of remove_column_d
+  for (int c_row = UP(id); c_row != id; c_row = UP(c_row)) {
     // find every element in that row
-    for (int elem = right[c_row]; elem != c_row; elem = right[elem]) {
+    COUNT(STAT_NODES, 1)
+    for (int elem = LEFT(c_row); elem != c_row; elem = LEFT(elem)) {
+      COUNT(STAT_NODES, 1)
       // attach that element
-      down[up[elem]] = elem;
-      up[down[elem]] = elem;
+      DOWN(UP(elem)) = elem;
+      UP(DOWN(elem)) = elem;
+      ++size[col[elem]];
     }
   }
 }
 
-kernel void exact_cover_kernel(global int *tasks, global int *_dlx,
-                               global int *dlxs, global const int *dlx_props,
-                               global int *answer, global int *answer_found,
-                               int dlx_size, int N, int task_count,
-                               local int *stacks) {
-  int l_id = get_local_id(0);
-  int g_id = get_global_id(0);
-  int l_size = get_local_size(0);
-
-  // printf("[%d:%d] starting! answer found: %d (%d)\n", g_id, l_id,
-  //        answer_found[0], answer_found[1]);
-  if (g_id >= task_count || answer_found[0] != -1)
-    return;
-
-  const __global int *col = dlx_props;
-  const __global int *row = dlx_props + dlx_size;
-
-  __global int *up, *down, *left, *right;
-  __global int *dlx = dlxs + g_id * dlx_size * 4;
-  __local int *stack = stacks + l_id * N * N;
+// choose the uncovered column with the fewest rows (Knuth's S heuristic)
+int choose_column_d(DLX_SPACE const link_t *dlx, int dlx_size STATS_PARAM) {
+  DLX_SPACE const link_t *right = LINK_PLANE(dlx, 3, dlx_size);
+  DLX_SPACE const link_t *size = dlx + dlx_size * 4;
 
-  for (int i = 0; i < dlx_size * 4; ++i) {
-    dlx[i] = _dlx[i];
+  int best = RIGHT(0);
+  for (int c_col = RIGHT(best); c_col != 0 && size[best] > 1;
+       c_col = RIGHT(c_col)) {
+    COUNT(STAT_NODES, 1)
+    if (size[c_col] < size[best])
+      best = c_col;
   }
-  barrier(CLK_LOCAL_MEM_FENCE);
+  return best;
+}
 
+// Depth-first search below a task prefix (task_depth rows, -1 ends it sooner), on a dlx copy
+// owned by the work-item. The first work-item covering every column claims answer_found and
+// copies its stack (the rows after the prefix) to answer. Unless limit is 1 the search goes on
+// after a cover, adding them up in found. Returns the search steps taken.
+int search_d(int task_id, __global const int *prefix, int task_depth,
+             DLX_SPACE link_t *dlx, __global const int *col, int dlx_size,
+             __local int *stack, __global int *answer,
+             __global int *answer_found, uint limit,
+             uint *found STATS_PARAM) {
+  DLX_SPACE link_t *up, *down, *left, *right, *size;
   UNLOAD(dlx, dlx_size);
 
-  int first_row = tasks[g_id];
-
-  remove_column_d(col[first_row], dlx, dlx_size);
-  for (int elem = right[first_row]; elem != first_row; elem = right[elem])
-    remove_column_d(col[elem], dlx, dlx_size);
+  for (int i = 0; i < task_depth && prefix[i] >= 0; ++i) {
+    int first_row = prefix[i];
+    remove_column_d(col[first_row], dlx, col, dlx_size STATS_ARG);
+    for (int elem = RIGHT(first_row); elem != first_row; elem = RIGHT(elem))
+      remove_column_d(col[elem], dlx, col, dlx_size STATS_ARG);
+  }
 
-  int top = 0;
+  int top = 0, steps = 0;
   int last_op = 0; // 0 - push stack, 1 - pop stack
   int c_col, c_row;
-  // printf("[%d:%d] Starting to search", g_id, l_id);
-  while (*answer_found == -1) {
-    // printf("[%d:%d] top: %d, last_op: %d, right[0]:%d\n", g_id, l_id, top,
-    //        last_op, right[0]);
+  while (!search_over_d(answer_found, limit)) {
+    ++steps;
     if (last_op == 0) {
-      if (right[0] == 0) {
+      if (RIGHT(0) == 0) {
         // every element has been covered, answer found
-        int old = atomic_cmpxchg(answer_found, -1, g_id);
-
-        // printf("[%d:%d] another answer! Previous: %d (%d)\n", g_id, l_id,
-        //        answer_found[0], answer_found[1]);
+        int old = atomic_cmpxchg(answer_found, -1, task_id);
 
         if (old == -1) {
           // copy answer to global memory
-
-          answer_found[1] = top;
-          // printf("answer: %d (%d)\n", answer_found[0], answer_found[1]);
+          answer_found[ANSWER_LENGTH] = top;
 
           for (int i = 0; i < top; ++i) {
             answer[i] = stack[i];
           }
         }
-        break;
+
+        ++*found;
+        if (limit > 1)
+          atomic_inc(answer_found + ANSWER_COUNTED);
+        if (limit == 1 || top == 0)
+          break;
+        // go on with the next row, counting every cover
+        POP()
+        continue;
       }
 
-      c_col = right[0];
-      c_row = down[c_col];
+      c_col = choose_column_d(dlx, dlx_size STATS_ARG);
+      c_row = DOWN(c_col);
       if (c_row == c_col) {
         // this column has not been covered
         if (top == 0)
@@ -125,13 +236,14 @@ kernel void exact_cover_kernel(global int *tasks, global int *_dlx,
       // read stack top and restore
 
       c_row = stack[top];
-      for (int elem = right[c_row]; elem != c_row; elem = right[elem])
-        restore_column_d(col[elem], dlx, dlx_size);
-      restore_column_d(col[c_row], dlx, dlx_size);
-      c_row = down[c_row]; // go to next row
+      c_col = col[c_row];
+      for (int elem = LEFT(c_row); elem != c_row; elem = LEFT(elem))
+        restore_column_d(col[elem], dlx, col, dlx_size STATS_ARG);
+      restore_column_d(c_col, dlx, col, dlx_size STATS_ARG);
+      c_row = DOWN(c_row); // go to next row
 
       // this column has finished iteration
-      if (c_row == right[0]) {
+      if (c_row == c_col) {
         // pop stack
         if (top == 0)
           break;
@@ -140,11 +252,366 @@ kernel void exact_cover_kernel(global int *tasks, global int *_dlx,
       }
     }
 
-    remove_column_d(col[c_row], dlx, dlx_size);
-    for (int elem = right[c_row]; elem != c_row; elem = right[elem])
-      remove_column_d(col[elem], dlx, dlx_size);
+    remove_column_d(col[c_row], dlx, col, dlx_size STATS_ARG);
+    for (int elem = RIGHT(c_row); elem != c_row; elem = RIGHT(elem))
+      remove_column_d(col[elem], dlx, col, dlx_size STATS_ARG);
 
     PUSH(c_row)
   }
-  // printf("[%d:%d] no answer!\n", g_id, l_id);
-}
\ No newline at end of file
+  return steps;
+}
+
+kernel void exact_cover_kernel(global int *tasks, global link_t *_dlx,
+                               DLX_SPACE link_t *dlxs, global const int *dlx_props,
+                               global int *answer, global int *answer_found,
+                               int dlx_size, int N, int task_count,
+                               int task_depth, uint limit, local int *stacks STATS_KERNEL_PARAM) {
+  int l_id = get_local_id(0);
+  int g_id = get_global_id(0);
+
+  if (g_id >= task_count || search_over_d(answer_found, limit))
+    return;
+
+  const __global int *col = dlx_props;
+
+  // a launch split in chunks (see the host) starts at the global offset of its
+  // first task, and its copies at 0
+  DLX_SPACE link_t *dlx =
+      dlxs + (size_t)COPY_ID(g_id - (int)get_global_offset(0), l_id) *
+                 dlx_size * DLX_PLANES;
+  __local int *stack = stacks + l_id * BOARD_CELLS;
+
+  // every work-item owns its copy and its stack, so no barrier is needed
+  // (one would also be reached by only part of the group after the early return)
+  for (int i = 0; i < dlx_size * DLX_PLANES; ++i) {
+    dlx[i] = _dlx[i];
+  }
+
+  TASK_STATS(g_id)
+  uint found = 0;
+  search_d(g_id, tasks + g_id * task_depth, task_depth, dlx, col, dlx_size,
+           stack, answer, answer_found, limit, &found STATS_ARG);
+  add_solutions_d(answer_found, found);
+}
+
+// Persistent threads: a grid sized to the device (one work-group per compute unit) keeps pulling
+// task indices from the queue counter until they run out or an answer is found, so a work-item
+// done with an empty subtree takes the next task instead of going idle. dlxs only holds one copy
+// per work-item (in local memory with -DDLX_LOCAL). loads receives the tasks taken and search
+// steps of every work-item.
+kernel void exact_cover_persistent_kernel(
+    global const int *tasks, global const link_t *_dlx, DLX_SPACE link_t *dlxs,
+    global const int *dlx_props, global int *answer, global int *answer_found,
+    int dlx_size, int N, int task_count, int task_depth, uint limit,
+    global int *queue, global int *loads, local int *stacks STATS_KERNEL_PARAM) {
+  int l_id = get_local_id(0);
+  int g_id = get_global_id(0);
+
+  const __global int *col = dlx_props;
+
+  DLX_SPACE link_t *dlx =
+      dlxs + (size_t)COPY_ID(g_id, l_id) * dlx_size * DLX_PLANES;
+  __local int *stack = stacks + l_id * BOARD_CELLS;
+
+  int taken = 0, steps = 0;
+  uint found = 0;
+  while (!search_over_d(answer_found, limit)) {
+    int task_id = atomic_inc(queue);
+    if (task_id >= task_count)
+      break;
+    TASK_STATS(task_id)
+
+    for (int i = 0; i < dlx_size * DLX_PLANES; ++i) {
+      dlx[i] = _dlx[i];
+    }
+
+    steps += search_d(task_id, tasks + task_id * task_depth, task_depth, dlx,
+                      col, dlx_size, stack, answer, answer_found, limit,
+                      &found STATS_ARG);
+    ++taken;
+  }
+  add_solutions_d(answer_found, found);
+
+  loads[g_id * 2] = taken;
+  loads[g_id * 2 + 1] = steps;
+}
+
+// fields of a puzzle in the puzzles table of exact_cover_multi_kernel
+#define PUZZLE_NODE_OFFSET 0
+#define PUZZLE_DLX_SIZE 1
+#define PUZZLE_TASK_OFFSET 2
+#define PUZZLE_FIELDS 3
+
+// Solve a whole batch of puzzles in one launch. Their dlx planes, props and tasks (task_depth
+// rows each) are packed one after the other: puzzles holds the offsets of each board, task_puzzle the board of each
+// task and scratch_offsets where its tasks copy their dlx in dlxs. Every board has its own
+// answer slot (N * N ints, N the largest board) and answer_data fields, so a board stops
+// searching as soon as it is solved while the others carry on.
+kernel void exact_cover_multi_kernel(
+    global const int *tasks, global const int *task_puzzle,
+    global const int *puzzles, SCRATCH_PARAM,
+    global const link_t *_dlx, DLX_SPACE link_t *dlxs, global const int *dlx_props,
+    global int *answer, global int *answer_data, int N, int task_count,
+    int task_depth, uint limit, local int *stacks STATS_KERNEL_PARAM) {
+  int l_id = get_local_id(0);
+  int g_id = get_global_id(0);
+
+  if (g_id >= task_count)
+    return;
+
+  int p = task_puzzle[g_id];
+  __global int *answer_found = answer_data + p * ANSWER_FIELDS;
+  if (search_over_d(answer_found, limit))
+    return;
+
+  __global const int *puzzle = puzzles + p * PUZZLE_FIELDS;
+  int node_offset = puzzle[PUZZLE_NODE_OFFSET];
+  int dlx_size = puzzle[PUZZLE_DLX_SIZE];
+  int task_id = g_id - puzzle[PUZZLE_TASK_OFFSET];
+
+  const __global int *col = dlx_props + node_offset * 2;
+  const __global link_t *dlx_template = _dlx + node_offset * DLX_PLANES;
+
+#ifdef DLX_LOCAL
+  DLX_SPACE link_t *dlx = dlxs + l_id * copy_stride;
+#else
+  DLX_SPACE link_t *dlx =
+      dlxs + scratch_offsets[p] + (ulong)task_id * dlx_size * DLX_PLANES;
+#endif
+  __local int *stack = stacks + l_id * BOARD_CELLS;
+
+  for (int i = 0; i < dlx_size * DLX_PLANES; ++i) {
+    dlx[i] = dlx_template[i];
+  }
+
+  TASK_STATS(g_id)
+  uint found = 0;
+  search_d(task_id, tasks + g_id * task_depth, task_depth, dlx, col, dlx_size,
+           stack, answer + p * BOARD_CELLS, answer_found, limit, &found STATS_ARG);
+  add_solutions_d(answer_found, found);
+}
+
+//region Lean kernels
+// The lean kernels never modify the dancing links: every work-item searches the shared template
+// and keeps its cover state as a bitset of the covered columns (one bit per column indicator,
+// cover_words uints), next to its stack in local memory. A row is still available when none of
+// its columns is covered, so the column sizes are counted on the fly instead of being unlinked.
+
+#define COVERED(covered, c) (((covered)[(c) >> 5] >> ((c) & 31)) & 1)
+
+// set (cover = 1) or clear the bits of every column of the row containing elem
+void cover_row_d(int elem, __global const link_t *right, __global const int *col,
+                 __local uint *covered, int cover STATS_PARAM) {
+  COUNT(cover ? STAT_REMOVES : STAT_RESTORES, 1)
+  int e = elem;
+  do {
+    COUNT(STAT_NODES, 1)
+    int c = col[e];
+    if (cover)
+      covered[c >> 5] |= 1u << (c & 31);
+    else
+      covered[c >> 5] &= ~(1u << (c & 31));
+    e = RIGHT(e);
+  } while (e != elem);
+}
+
+int row_available_d(int elem, __global const link_t *right,
+                    __global const int *col,
+                    __local const uint *covered STATS_PARAM) {
+  for (int e = RIGHT(elem); e != elem; e = RIGHT(e)) {
+    COUNT(STAT_NODES, 1)
+    if (COVERED(covered, col[e]))
+      return 0;
+  }
+  return 1;
+}
+
+// next available row of the column of elem below it, the column indicator when there is none
+int next_row_d(int elem, __global const link_t *down,
+               __global const link_t *right,
+               __global const int *col,
+               __local const uint *covered STATS_PARAM) {
+  int c_row = DOWN(elem);
+  while (c_row != col[elem] &&
+         !row_available_d(c_row, right, col, covered STATS_ARG))
+    c_row = DOWN(c_row);
+  return c_row;
+}
+
+// uncovered column with the fewest available rows, 0 when every column is covered
+int choose_column_lean_d(__global const link_t *dlx, __global const int *col,
+                         int dlx_size,
+                         __local const uint *covered STATS_PARAM) {
+  __global const link_t *down = LINK_PLANE(dlx, 1, dlx_size);
+  __global const link_t *right = LINK_PLANE(dlx, 3, dlx_size);
+
+  int best = 0, best_size = 0;
+  for (int c_col = RIGHT(0); c_col != 0; c_col = RIGHT(c_col)) {
+    if (COVERED(covered, c_col))
+      continue;
+
+    int c_size = 0;
+    for (int c_row = DOWN(c_col); c_row != c_col && (best == 0 || c_size < best_size);
+         c_row = DOWN(c_row))
+      c_size += row_available_d(c_row, right, col, covered STATS_ARG);
+
+    if (best == 0 || c_size < best_size) {
+      best = c_col;
+      best_size = c_size;
+      if (best_size <= 1)
+        break;
+    }
+  }
+  return best;
+}
+
+// same search as search_d, on the cover bitset instead of a private copy of the links
+int search_lean_d(int task_id, __global const int *prefix, int task_depth,
+                  __global const link_t *dlx, __global const int *col,
+                  int dlx_size, __local int *stack, __local uint *covered,
+                  int cover_words, __global int *answer,
+                  __global int *answer_found, uint limit,
+                  uint *found STATS_PARAM) {
+  __global const link_t *down = LINK_PLANE(dlx, 1, dlx_size);
+  __global const link_t *right = LINK_PLANE(dlx, 3, dlx_size);
+
+  for (int i = 0; i < cover_words; ++i)
+    covered[i] = 0;
+  for (int i = 0; i < task_depth && prefix[i] >= 0; ++i)
+    cover_row_d(prefix[i], right, col, covered, 1 STATS_ARG);
+
+  int top = 0, steps = 0;
+  int last_op = 0; // 0 - push stack, 1 - pop stack
+  int c_col, c_row;
+  while (!search_over_d(answer_found, limit)) {
+    ++steps;
+    if (last_op == 0) {
+      c_col = choose_column_lean_d(dlx, col, dlx_size, covered STATS_ARG);
+      if (c_col == 0) {
+        // every element has been covered, answer found
+        int old = atomic_cmpxchg(answer_found, -1, task_id);
+
+        if (old == -1) {
+          // copy answer to global memory
+          answer_found[ANSWER_LENGTH] = top;
+
+          for (int i = 0; i < top; ++i) {
+            answer[i] = stack[i];
+          }
+        }
+
+        ++*found;
+        if (limit > 1)
+          atomic_inc(answer_found + ANSWER_COUNTED);
+        if (limit == 1 || top == 0)
+          break;
+        // go on with the next row, counting every cover
+        POP()
+        continue;
+      }
+
+      c_row = next_row_d(c_col, down, right, col, covered STATS_ARG);
+    } else {
+      // read stack top, uncover it and go to the next available row
+      c_row = stack[top];
+      c_col = col[c_row];
+      cover_row_d(c_row, right, col, covered, 0 STATS_ARG);
+      c_row = next_row_d(c_row, down, right, col, covered STATS_ARG);
+    }
+
+    // this column has no (more) rows
+    if (c_row == c_col) {
+      if (top == 0)
+        break;
+      POP()
+      continue;
+    }
+
+    cover_row_d(c_row, right, col, covered, 1 STATS_ARG);
+    PUSH(c_row)
+  }
+  return steps;
+}
+
+kernel void exact_cover_lean_kernel(global int *tasks, global const link_t *dlx,
+                                    global const int *dlx_props,
+                                    global int *answer,
+                                    global int *answer_found, int dlx_size,
+                                    int N, int task_count, int task_depth,
+                                    uint limit, local int *stacks,
+                                    int cover_words, local uint *covers STATS_KERNEL_PARAM) {
+  int l_id = get_local_id(0);
+  int g_id = get_global_id(0);
+
+  if (g_id >= task_count || search_over_d(answer_found, limit))
+    return;
+
+  TASK_STATS(g_id)
+  uint found = 0;
+  search_lean_d(g_id, tasks + g_id * task_depth, task_depth, dlx, dlx_props,
+                dlx_size, stacks + l_id * BOARD_CELLS, covers + l_id * cover_words,
+                cover_words, answer, answer_found, limit, &found STATS_ARG);
+  add_solutions_d(answer_found, found);
+}
+
+// exact_cover_persistent_kernel on the shared template
+kernel void exact_cover_lean_persistent_kernel(
+    global const int *tasks, global const link_t *dlx, global const int *dlx_props,
+    global int *answer, global int *answer_found, int dlx_size, int N,
+    int task_count, int task_depth, uint limit, global int *queue,
+    global int *loads, local int *stacks, int cover_words,
+    local uint *covers STATS_KERNEL_PARAM) {
+  int l_id = get_local_id(0);
+  int g_id = get_global_id(0);
+
+  int taken = 0, steps = 0;
+  uint found = 0;
+  while (!search_over_d(answer_found, limit)) {
+    int task_id = atomic_inc(queue);
+    if (task_id >= task_count)
+      break;
+    TASK_STATS(task_id)
+
+    steps += search_lean_d(task_id, tasks + task_id * task_depth, task_depth,
+                           dlx, dlx_props, dlx_size, stacks + l_id * BOARD_CELLS,
+                           covers + l_id * cover_words, cover_words, answer,
+                           answer_found, limit, &found STATS_ARG);
+    ++taken;
+  }
+  add_solutions_d(answer_found, found);
+
+  loads[g_id * 2] = taken;
+  loads[g_id * 2 + 1] = steps;
+}
+
+// exact_cover_multi_kernel without the dlx copies, see there for the packed buffers
+kernel void exact_cover_lean_multi_kernel(
+    global const int *tasks, global const int *task_puzzle,
+    global const int *puzzles, global const link_t *dlx,
+    global const int *dlx_props, global int *answer, global int *answer_data,
+    int N, int task_count, int task_depth, uint limit, local int *stacks,
+    int cover_words, local uint *covers STATS_KERNEL_PARAM) {
+  int l_id = get_local_id(0);
+  int g_id = get_global_id(0);
+
+  if (g_id >= task_count)
+    return;
+
+  int p = task_puzzle[g_id];
+  __global int *answer_found = answer_data + p * ANSWER_FIELDS;
+  if (search_over_d(answer_found, limit))
+    return;
+
+  __global const int *puzzle = puzzles + p * PUZZLE_FIELDS;
+  int node_offset = puzzle[PUZZLE_NODE_OFFSET];
+
+  TASK_STATS(g_id)
+  uint found = 0;
+  search_lean_d(g_id - puzzle[PUZZLE_TASK_OFFSET], tasks + g_id * task_depth,
+                task_depth, dlx + node_offset * DLX_PLANES,
+                dlx_props + node_offset * 2, puzzle[PUZZLE_DLX_SIZE],
+                stacks + l_id * BOARD_CELLS, covers + l_id * cover_words, cover_words,
+                answer + p * BOARD_CELLS, answer_found, limit, &found STATS_ARG);
+  add_solutions_d(answer_found, found);
+}
+//endregion
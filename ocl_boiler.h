@@ -162,9 +162,10 @@ cl_command_queue create_queue(cl_context ctx, cl_device_id d) {
 }
 
 // Compile the device part of the program, stored in the external
-// file `fname`, for device `dev` in context `ctx`
-cl_program create_program(const char *const fname, cl_context ctx,
-                          cl_device_id dev) {
+// file `fname`, for device `dev` in context `ctx`, with the compiler
+// options `options` (e.g. "-I. -DNAME")
+cl_program create_program_with_options(const char *const fname, cl_context ctx,
+                                       cl_device_id dev, const char *options) {
     cl_int err, errlog;
     cl_program prg;
 
@@ -184,12 +185,12 @@ cl_program create_program(const char *const fname, cl_context ctx,
     prg = clCreateProgramWithSource(ctx, 1, &buf_ptr, NULL, &err);
     ocl_check(err, "create program");
 
-    err = clBuildProgram(prg, 1, &dev, "-I.", NULL, NULL);
+    err = clBuildProgram(prg, 1, &dev, options, NULL, NULL);
     errlog = clGetProgramBuildInfo(prg, dev, CL_PROGRAM_BUILD_LOG,
                                    0, NULL, &logsize);
     ocl_check(errlog, "get program build log size");
 
-    log_buf = malloc(logsize);
+    log_buf = malloc(logsize + 2);
     errlog = clGetProgramBuildInfo(prg, dev, CL_PROGRAM_BUILD_LOG,
                                    logsize, log_buf, NULL);
     ocl_check(errlog, "get program build log");
@@ -205,14 +206,21 @@ cl_program create_program(const char *const fname, cl_context ctx,
     } else {
         log_buf[logsize] = '\0';
     }
-    if (OCL_BOILER_INIT_INFO) {
-        printf("=== BUILD LOG ===\n%s\n=========\n", log_buf);
+    // a failed build is always reported, and never handed back (nor cached)
+    if (OCL_BOILER_INIT_INFO || err != CL_SUCCESS) {
+        fprintf(err != CL_SUCCESS ? stderr : stdout, "=== BUILD LOG ===\n%s\n=========\n", log_buf);
         ocl_check(err, "build program");
     }
+    free(log_buf);
 
     return prg;
 }
 
+cl_program create_program(const char *const fname, cl_context ctx,
+                          cl_device_id dev) {
+    return create_program_with_options(fname, ctx, dev, "-I.");
+}
+
 // Runtime of an event, in nanoseconds. Note that if NS is the
 // runtimen of an event in nanoseconds and NB is the number of byte
 // read and written during the event, NB/NS is the effective bandwidth
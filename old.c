@@ -45,18 +45,14 @@ void solve(const int *board, int n, int lws) {
     int *col_ids, *row_ids, *convert_table;
     int *dlx;
     int placed;
-    int **valid_candidates = (int **) malloc(N * N * sizeof(int *));
+    struct Arena arena = {0};
+    unsigned char *valid_candidates = initial_check(board, n, &placed, &arena);
 
-    for (int i = 0; i < N * N; ++i) {
-        valid_candidates[i] = (int *) calloc(N, sizeof(int));
-    }
-    initial_check(board, n, valid_candidates, &placed);
-
-    int num_elems = convert_matrix(board, valid_candidates, placed, n, &col_ids, &row_ids, &convert_table);
-    int dlx_size = build_dancing_links(col_ids, row_ids, num_elems, &dlx);
-    int *dlx_props = dlx + 4 * dlx_size;
+    int num_elems = convert_matrix(board, valid_candidates, placed, n, &col_ids, &row_ids, &convert_table, &arena);
+    int dlx_size = build_dancing_links(col_ids, row_ids, num_elems, &dlx, &arena);
+    int *dlx_props = dlx + DLX_PLANES * dlx_size;
 
-    memory = memory_string(dlx_size * 4 * sizeof(int));
+    memory = memory_string(dlx_size * DLX_PLANES * sizeof(int));
 
     printf("Number of nodes in dancing links: %d (~%llu %s)\n", dlx_size,
            memory.value, memory.unit);
@@ -65,11 +61,11 @@ void solve(const int *board, int n, int lws) {
     //region Generate tasks
     int estimated_tasks_count = dlx_size - N * N - 1;
 
-    memory = memory_string(dlx_size * 4 * estimated_tasks_count * sizeof(int));
+    memory = memory_string(dlx_size * DLX_PLANES * estimated_tasks_count * sizeof(int));
 
     printf("Generating %d tasks (taking ~%llu %s of memory)...\n", estimated_tasks_count, memory.value, memory.unit);
 
-    int *dlxs = (int *) malloc(dlx_size * 4 * estimated_tasks_count * sizeof(int));
+    int *dlxs = (int *) malloc(dlx_size * DLX_PLANES * estimated_tasks_count * sizeof(int));
     int *answers = (int *) malloc(sizeof(int) * estimated_tasks_count);
 
     int c_tasks_count = permutate_tasks(dlx, dlx_size, n, dlxs, answers, estimated_tasks_count);
@@ -105,10 +101,10 @@ void solve(const int *board, int n, int lws) {
     answer_data[0] = -1;
     answer_data[1] = 0;
 
-    struct Info info = initialize("old.cl", "exact_cover_kernel");
+    struct Info info = initialize("old.cl", "exact_cover_kernel", "-I.");
 
     cl_mem d_dlxs = clCreateBuffer(info.context, CL_MEM_READ_WRITE | CL_MEM_HOST_WRITE_ONLY,
-                                   dlx_size * 4 * c_tasks_count * sizeof(int), NULL, &err);
+                                   dlx_size * DLX_PLANES * c_tasks_count * sizeof(int), NULL, &err);
     ocl_check(err, "create buffer for dlxs");
 
     cl_mem d_dlx_props = clCreateBuffer(info.context,
@@ -126,8 +122,9 @@ void solve(const int *board, int n, int lws) {
                                           sizeof(int) * 2, NULL, &err);
     ocl_check(err, "create buffer for ans_found");
 
-    memory = memory_string(dlx_size * 4 * c_tasks_count * sizeof(int));
-    printf("Device buffer dlxs size: %d (%llu %s)\n", dlx_size * 4 * c_tasks_count, memory.value, memory.unit);
+    memory = memory_string(dlx_size * DLX_PLANES * c_tasks_count * sizeof(int));
+    printf("Device buffer dlxs size: %d (%llu %s)\n", dlx_size * DLX_PLANES * c_tasks_count,
+           memory.value, memory.unit);
     memory = memory_string(dlx_size * 2 * sizeof(int));
     printf("Device buffer dlx_props size: %d (%llu %s)\n", dlx_size * 2, memory.value, memory.unit);
     memory = memory_string(N * N * sizeof(int));
@@ -144,7 +141,7 @@ void solve(const int *board, int n, int lws) {
     ocl_check(err, "write answer_data");
 
     err = clEnqueueWriteBuffer(info.queue, d_dlxs,
-                               CL_FALSE, 0, dlx_size * 4 * c_tasks_count * sizeof(int), dlxs,
+                               CL_FALSE, 0, dlx_size * DLX_PLANES * c_tasks_count * sizeof(int), dlxs,
                                0, NULL, &evt_writes[1]);
     ocl_check(err, "write dlxs");
 
@@ -182,7 +179,7 @@ void solve(const int *board, int n, int lws) {
         ocl_check(err, "read answer");
 
         for (int i = 0; i < answer_length; ++i) answer[i] = dlx_props[answer[i] + dlx_size]; // convert to row numbers
-        convert_answer_print(answers[answer_found], answer, convert_table, N);
+        convert_answer_print(&answers[answer_found], 1, answer, N * N - 1, convert_table, N);
 
         free(answer);
     }
@@ -197,21 +194,16 @@ void solve(const int *board, int n, int lws) {
     clReleaseMemObject(d_answer_data);
 
     free(dlxs);
-    free(dlx);
-    free(convert_table);
-    free(col_ids);
-    free(row_ids);
     free(answer_data);
-    for (int i = 0; i < N * N; ++i) free(valid_candidates[i]);
-    free(valid_candidates);
+    arena_free(&arena);
     //endregion
 }
 
 int permutate_tasks(const int *dlx, int dlx_size, int n, int *dlxs, int *answers, int slots) {
     const int *b_down = dlx + 1 * dlx_size;
     const int *b_right = dlx + 3 * dlx_size;
-    const int *b_col = dlx + 4 * dlx_size;
-    const int *b_row = dlx + 5 * dlx_size;
+    const int *b_col = dlx + DLX_PLANES * dlx_size;
+    const int *b_row = dlx + (DLX_PLANES + 1) * dlx_size;
 
     int count = 0;
 
@@ -227,17 +219,17 @@ int permutate_tasks(const int *dlx, int dlx_size, int n, int *dlxs, int *answers
                 continue;
             }
 
-            memcpy(dlxs + count * dlx_size * 4, dlx, sizeof(int) * dlx_size * 4);
-            int *c_dlx = dlxs + count * dlx_size * 4;
+            memcpy(dlxs + count * dlx_size * DLX_PLANES, dlx, sizeof(int) * dlx_size * DLX_PLANES);
+            int *c_dlx = dlxs + count * dlx_size * DLX_PLANES;
 
             const int *c_right = dlx + 3 * dlx_size;
 
 //            printf("[#%d] task: (%d, %d)\n", count, c_col, c_row);
 //            printf("[#%d] right[0]: %d\n", count, c_right[0]);
 
-            remove_column(c_col, c_dlx, dlx_size);
+            remove_column(c_col, c_dlx, b_col, dlx_size);
             for (int elem = c_right[c_row]; elem != c_row; elem = c_right[elem]) {
-                remove_column(b_col[elem], c_dlx, dlx_size);
+                remove_column(b_col[elem], c_dlx, b_col, dlx_size);
             }
 
             if (c_right[0] == 0) {
@@ -66,7 +66,7 @@ kernel void exact_cover_kernel(global int *dlxs, global const int *dlx_props,
   const __global int *row = dlx_props + dlx_size;
 
   __global int *up, *down, *left, *right;
-  __global int *dlx = dlxs + g_id * dlx_size * 4;
+  __global int *dlx = dlxs + g_id * dlx_size * 5; // host slots also carry the column sizes
   __local int *stack = stacks + l_id * N * N;
   UNLOAD(dlx, dlx_size);
 
@@ -1,31 +1,373 @@
 #include <math.h>
+#include <time.h>
+#include <ctype.h>
+#include <limits.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #define SERIAL_COORD(i, j, N) ((i) * N + (j))
 #define ROW(p, N) ((p) / N)
 #define COL(p, N) ((p) % N)
 #define BOX(p, n) ((p) / (n * n * n) * n + ((p) % (n * n)) / n)
+// j-th cell of the u-th row (kind 0), column (kind 1) or box (kind 2)
+#define UNIT_CELL(kind, u, j, n) ((kind) == 0 ? (u) * (n) * (n) + (j) : \
+    (kind) == 1 ? (j) * (n) * (n) + (u) : \
+    ((u) / (n) * (n) + (j) / (n)) * (n) * (n) + (u) % (n) * (n) + (j) % (n))
+// up, down, left, right and the column sizes, followed by the col/row props
+#define DLX_PLANES 5
+// The links take the first 4 * dlx_size ints: four planes of dlx_size ints by default (struct of
+// arrays), or with DLX_AOS one 16-byte {up, down, left, right} record per node (array of structs),
+// so that unlinking a node reads one cache line instead of three. The sizes plane follows either.
+// The links are read and written through UP(x), DOWN(x), LEFT(x) and RIGHT(x).
+#ifdef DLX_AOS
+#define LINK_STRIDE 4
+#define LINK_PLANE(dlx, k, dlx_size) ((dlx) + (k))
+#define DLX_LAYOUT_OPTION " -DDLX_AOS"
+#else
+#define LINK_STRIDE 1
+#define LINK_PLANE(dlx, k, dlx_size) ((dlx) + (dlx_size) * (k))
+#define DLX_LAYOUT_OPTION ""
+#endif
+#define UP(x) up[(x) * LINK_STRIDE]
+#define DOWN(x) down[(x) * LINK_STRIDE]
+#define LEFT(x) left[(x) * LINK_STRIDE]
+#define RIGHT(x) right[(x) * LINK_STRIDE]
 #define UNLOAD_NO_PROPS(dlx, dlx_size) \
-    up    = (dlx); \
-    down  = (dlx) + dlx_size; \
-    left  = (dlx) + dlx_size * 2; \
-    right = (dlx) + dlx_size * 3;
+    up    = LINK_PLANE(dlx, 0, dlx_size); \
+    down  = LINK_PLANE(dlx, 1, dlx_size); \
+    left  = LINK_PLANE(dlx, 2, dlx_size); \
+    right = LINK_PLANE(dlx, 3, dlx_size); \
+    size  = (dlx) + dlx_size * 4;
 #define UNLOAD(dlx, dlx_props, dlx_size) \
     UNLOAD_NO_PROPS(dlx, dlx_size) \
     col   = (dlx_props); \
     row   = (dlx_props) + dlx_size;
 
+#define LOG(...) do { if (verbose) printf(__VA_ARGS__); } while (0)
+
+// progress messages are silenced in batch mode, where stdout carries the solutions
+int verbose = 1;
+
+// --count / --limit <k> / --unique (--limit 2): solutions to find before the search stops,
+// 0 counts all of them
+unsigned int solution_limit = 1;
+
+// "+" when a search stopped at the limit, so there may be more solutions than reported
+const char *limit_suffix(unsigned int solutions) {
+    return solution_limit > 1 && solutions >= solution_limit ? "+" : "";
+}
+
+//region Timing
+// monotonic wall clock, in microseconds
+double wall_time_us() {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double) counter.QuadPart * 1000000 / (double) frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1000000 + (double) ts.tv_nsec / 1000;
+#endif
+}
+
+// Microseconds spent in each phase of a run, summed over the puzzles of a batch
+struct Timings {
+    double setup;    // propagation, and the OpenCL platform, context and program
+    double build;    // build_board_links
+    double tasks;    // task generation
+    double transfer; // host <-> device copies (profiling events)
+    double search;   // exact cover search or kernel (profiling events)
+};
+
+struct Timings timings = {0};
+
+// --timings: end the run with print_timings
+int report_timings = 0;
+
+// one "timings;setup;build;tasks;transfer;search" line, in microseconds, as read by dlx_bench
+void print_timings() {
+    if (report_timings)
+        printf("timings;%f;%f;%f;%f;%f\n", timings.setup, timings.build, timings.tasks, timings.transfer,
+               timings.search);
+}
+//endregion
+
+// decode a cell of the one-line format: '.' or '0' blank, then 1-9 and A-Z for 10 and above
+int cell_from_char(char c) {
+    if (c >= '1' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'Z') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'z') return c - 'a' + 10;
+    return 0;
+}
+
+char cell_to_char(int cell) {
+    if (cell <= 0) return '.';
+    if (cell <= 9) return (char) ('0' + cell);
+    return (char) ('A' + cell - 10);
+}
+
+// Whether every cell of an N x N board is blank or a number up to N, saying which one is not.
+// The setup indexes its tables with the cells, so a puzzle failing this is skipped.
+int valid_cells(const int *board, int N) {
+    for (int i = 0; i < N * N; ++i)
+        if (board[i] < 0 || board[i] > N) {
+            fprintf(stderr, "Skipping puzzle: cell %d is not a number from 0 to %d.\n", i, N);
+            return 0;
+        }
+    return 1;
+}
+
+// Read the next puzzle of a stream, either in the read_board format (n followed by
+// the N * N cells) or as one line of N * N characters. Returns NULL at the end of the stream.
+int *read_board_stream(FILE *fp, int *n) {
+    char token[4097];
+    int i;
+
+    while (fscanf(fp, "%4096s", token) == 1) {
+        int length = (int) strlen(token);
+
+        if (length < 4) {
+            *n = atoi(token);
+            if (*n < 1) {
+                fprintf(stderr, "Skipping %s: not a board size.\n", token);
+                continue;
+            }
+            int N = *n * *n;
+            int *board = (int *) calloc(N * N, sizeof(int));
+            for (i = 0; i < N * N; ++i)
+                if (fscanf(fp, "%d", board + i) != 1) {
+                    // not a number: its token is skipped with the puzzle
+                    if (fscanf(fp, "%*s") == EOF) {
+                        fprintf(stderr, "Skipping puzzle: the stream ends after %d of its %d cells.\n", i, N * N);
+                        free(board);
+                        return NULL;
+                    }
+                    board[i] = -1;
+                }
+            if (!valid_cells(board, N)) {
+                free(board);
+                continue;
+            }
+            return board;
+        }
+
+        int N = (int) (sqrt(length) + 0.5);
+        *n = (int) (sqrt(N) + 0.5);
+        if (*n * *n * *n * *n != length) {
+            fprintf(stderr, "Skipping puzzle line of %d characters: not a square board.\n", length);
+            continue;
+        }
+
+        int *board = (int *) calloc(length, sizeof(int));
+        for (i = 0; i < length; ++i)
+            board[i] = cell_from_char(token[i]);
+        if (!valid_cells(board, N)) {
+            free(board);
+            continue;
+        }
+        return board;
+    }
+    return NULL;
+}
+
+//region Board streams
+// The puzzles of a corpus are parsed in place: a regular file is mapped in memory and walked token
+// by token, and every board is decoded into one buffer owned by the stream, reused by the next one.
+// stdin ("-"), and every file on Windows, go through read_board_stream instead.
+struct BoardStream {
+    FILE *fp;         // when the input is not mapped
+    const char *data; // the mapped file
+    size_t size;
+    size_t offset;    // where the next token starts
+    int *board;       // the last board returned
+    size_t capacity;  // cells of board
+};
+
+// Open a corpus for next_board. Returns 0 (after saying why) when it cannot be read.
+int open_board_stream(const char *file_name, struct BoardStream *stream) {
+    *stream = (struct BoardStream) {0};
+    if (strcmp(file_name, "-") == 0) {
+        stream->fp = stdin;
+        return 1;
+    }
+#ifndef _WIN32
+    int fd = open(file_name, O_RDONLY);
+    struct stat info;
+    if (fd >= 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void *data = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, (size_t) info.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            stream->data = (const char *) data;
+            stream->size = (size_t) info.st_size;
+            return 1;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+#endif
+    stream->fp = fopen(file_name, "r");
+    if (stream->fp == NULL) {
+        fprintf(stderr, "Cannot open %s\n", file_name);
+        return 0;
+    }
+    return 1;
+}
+
+void close_board_stream(struct BoardStream *stream) {
+#ifndef _WIN32
+    if (stream->data != NULL)
+        munmap((void *) stream->data, stream->size);
+#endif
+    if (stream->fp != NULL && stream->fp != stdin)
+        fclose(stream->fp);
+    free(stream->board);
+    *stream = (struct BoardStream) {0};
+}
+
+// next whitespace-separated token of the mapped data, NULL at its end
+const char *next_token(struct BoardStream *stream, size_t *length) {
+    const char *data = stream->data;
+    size_t i = stream->offset;
+    while (i < stream->size && isspace((unsigned char) data[i]))
+        ++i;
+    size_t start = i;
+    while (i < stream->size && !isspace((unsigned char) data[i]))
+        ++i;
+    stream->offset = i;
+    *length = i - start;
+    return i > start ? data + start : NULL;
+}
+
+// the int spelled by a token, -1 when it is not a number
+int token_to_int(const char *token, size_t length) {
+    int value = 0;
+    for (size_t i = 0; i < length; ++i) {
+        if (token[i] < '0' || token[i] > '9' || value > INT_MAX / 10)
+            return -1;
+        value = value * 10 + token[i] - '0';
+    }
+    return value;
+}
+
+// make room for cells cells in the board of the stream
+int *stream_board(struct BoardStream *stream, size_t cells) {
+    if (cells > stream->capacity) {
+        free(stream->board);
+        stream->board = (int *) malloc(cells * sizeof(int));
+        stream->capacity = cells;
+    }
+    return stream->board;
+}
+
+// Read the next puzzle of a stream, in either format of read_board_stream. Returns NULL at the end
+// of the stream. The board belongs to the stream and is overwritten by the next call.
+int *next_board(struct BoardStream *stream, int *n) {
+    if (stream->fp != NULL) {
+        int *board = read_board_stream(stream->fp, n);
+        free(stream->board);
+        stream->board = board;
+        stream->capacity = board != NULL ? (size_t) *n * *n * *n * *n : 0;
+        return board;
+    }
+
+    const char *token;
+    size_t length;
+    while ((token = next_token(stream, &length)) != NULL) {
+        if (length < 4) {
+            *n = token_to_int(token, length);
+            if (*n < 1) {
+                fprintf(stderr, "Skipping %.*s: not a board size.\n", (int) length, token);
+                continue;
+            }
+            int N = *n * *n;
+            int *board = stream_board(stream, (size_t) N * N);
+            // a bad cell skips the puzzle, but all of its cells are read so that the next one is found
+            for (int i = 0; i < N * N; ++i) {
+                token = next_token(stream, &length);
+                if (token == NULL) {
+                    fprintf(stderr, "Skipping puzzle: the stream ends after %d of its %d cells.\n", i, N * N);
+                    return NULL;
+                }
+                board[i] = token_to_int(token, length);
+            }
+            if (!valid_cells(board, N))
+                continue;
+            return board;
+        }
+
+        int N = (int) (sqrt((double) length) + 0.5);
+        *n = (int) (sqrt(N) + 0.5);
+        if ((size_t) *n * *n * *n * *n != length) {
+            fprintf(stderr, "Skipping puzzle line of %zu characters: not a square board.\n", length);
+            continue;
+        }
+
+        int *board = stream_board(stream, length);
+        for (size_t i = 0; i < length; ++i)
+            board[i] = cell_from_char(token[i]);
+        if (!valid_cells(board, N))
+            continue;
+        return board;
+    }
+    return NULL;
+}
+//endregion
 
+// Read the first board of a file in either format of read_board_stream, exiting when there is none
 int *read_board(const char *file_name, int *n) {
-    FILE *fp = fopen(file_name, "r");
-    int *board = NULL;
+    struct BoardStream stream;
+    if (!open_board_stream(file_name, &stream))
+        exit(1);
+    int *board = next_board(&stream, n);
+    if (board == NULL) {
+        fprintf(stderr, "No board in %s\n", file_name);
+        exit(1);
+    }
 
-    fscanf(fp, "%d", n);
     int N = *n * *n;
-    int total = N * N, i;
-    board = (int *) calloc(total, sizeof(int));
-    for (i = 0; i < total; ++i)
-        fscanf(fp, "%d", board + i);
-    return board;
+    int *copy = (int *) malloc(N * N * sizeof(int));
+    memcpy(copy, board, N * N * sizeof(int));
+    close_board_stream(&stream);
+    return copy;
+}
+
+// write a board as one line of N * N characters, line must hold N * N + 1 chars
+void board_to_line(const int *board, int N, char *line) {
+    int i;
+    for (i = 0; i < N * N; ++i)
+        line[i] = cell_to_char(board[i]);
+    line[i] = '\0';
+}
+
+// print the batch line of a puzzle: its first solution or "no solution", followed by the number
+// of solutions found when they are counted
+void print_result_line(const int *solution, int N, unsigned int solutions) {
+    if (solutions == 0) {
+        printf("no solution");
+    } else if (N > 35) {
+        // past Z, one character per cell is not enough: comma-separated numbers
+        for (int i = 0; i < N * N; ++i)
+            printf(i > 0 ? ",%d" : "%d", solution[i]);
+    } else {
+        char *line = malloc(N * N + 1);
+        board_to_line(solution, N, line);
+        printf("%s", line);
+        free(line);
+    }
+    if (solution_limit != 1)
+        printf(" %u%s", solutions, limit_suffix(solutions));
+    printf("\n");
 }
 
 void _print_board_le9(const int *board, int N) {
@@ -67,19 +409,19 @@ void _print_board_le9(const int *board, int N) {
 void _print_board_gt9(const int *board, int N) {
     int n = sqrt(N);
 
-    int i, j, cell;
+    // every cell is as wide as the biggest number
+    int width = 1;
+    for (int biggest = N; biggest > 9; biggest /= 10)
+        ++width;
+
+    int i, j, k, cell;
     for (i = 0; i < N; ++i) {
         for (j = 0; j < N; ++j) {
             cell = board[SERIAL_COORD(i, j, N)];
             if (cell > 0) {
-                if (cell > 9) {
-                    printf("%d", cell);
-                } else {
-                    printf(" %d", cell);
-
-                }
+                printf("%*d", width, cell);
             } else {
-                printf("  ");
+                printf("%*s", width, "");
             }
 
             if (j % n == (n - 1) && j < (N - 1)) printf("|");
@@ -88,7 +430,8 @@ void _print_board_gt9(const int *board, int N) {
         if (i % n == (n - 1) && i < (N - 1)) {
             printf("\n");
             for (j = 0; j < N; ++j) {
-                printf("--");
+                for (k = 0; k < width; ++k)
+                    printf("-");
                 if (j % n == (n - 1) && j < (N - 1)) {
                     printf("+");
                 } else if (j % N == (N - 1)) {
@@ -139,9 +482,89 @@ int check_partial_board(const int *board, int n, int p, int num) {
     return 1;
 }
 
-// populate the valid_candidates array with the possible candidates for each cell
-void initial_check(const int *board, int n, int **valid_candidates, int *placed) {
+//region Arena
+// Bump allocator for the setup structures of a puzzle (candidates, exact cover matrix, dancing links),
+// all released at once by arena_reset before the next puzzle. It grows by chaining blocks, and a
+// reset after an overflow merges them into one block big enough for that puzzle, so a batch soon
+// settles on a single allocation. Every thread preparing puzzles needs its own arena.
+struct ArenaBlock {
+    struct ArenaBlock *next; // the block filled before this one
+    size_t size;
+    size_t used;
+};
+
+struct Arena {
+    struct ArenaBlock *block; // the block being filled, NULL before the first allocation
+};
+
+#define ARENA_ALIGN 16
+#define ARENA_FIRST_BLOCK (64 * 1024)
+// the allocations of a block start after its header, kept aligned
+#define ARENA_HEADER ((sizeof(struct ArenaBlock) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+
+struct ArenaBlock *arena_block(size_t size, struct ArenaBlock *next) {
+    struct ArenaBlock *block = (struct ArenaBlock *) malloc(ARENA_HEADER + size);
+    if (block == NULL) {
+        fprintf(stderr, "Cannot allocate an arena block of %zu bytes\n", size);
+        exit(1);
+    }
+    block->next = next;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void *arena_alloc(struct Arena *arena, size_t bytes) {
+    bytes = (bytes + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    struct ArenaBlock *block = arena->block;
+    if (block == NULL || block->size - block->used < bytes) {
+        size_t size = block != NULL ? block->size * 2 : ARENA_FIRST_BLOCK;
+        while (size < bytes)
+            size *= 2;
+        arena->block = block = arena_block(size, block);
+    }
+    void *data = (char *) block + ARENA_HEADER + block->used;
+    block->used += bytes;
+    return data;
+}
+
+void *arena_calloc(struct Arena *arena, size_t count, size_t size) {
+    void *data = arena_alloc(arena, count * size);
+    memset(data, 0, count * size);
+    return data;
+}
+
+void arena_free(struct Arena *arena) {
+    struct ArenaBlock *block = arena->block;
+    while (block != NULL) {
+        struct ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->block = NULL;
+}
+
+// release every allocation of the arena, keeping (or merging) its memory for the next puzzle
+void arena_reset(struct Arena *arena) {
+    struct ArenaBlock *block = arena->block;
+    if (block == NULL)
+        return;
+    if (block->next != NULL) {
+        size_t total = 0;
+        for (; block != NULL; block = block->next)
+            total += block->size;
+        arena_free(arena);
+        arena->block = arena_block(total, NULL);
+    }
+    arena->block->used = 0;
+}
+//endregion
+
+// The candidates of a board, one byte per cell and number: candidate d + 1 of cell i is
+// valid_candidates[i * N + d]. Allocated from arena, returns them and the number of given cells in placed.
+unsigned char *initial_check(const int *board, int n, int *placed, struct Arena *arena) {
     int N = n * n, i, cand;
+    unsigned char *valid_candidates = (unsigned char *) arena_calloc(arena, (size_t) N * N * N, 1);
     *placed = 0;
     for (i = 0; i < N * N; ++i) {
         if (board[i] != 0) {
@@ -150,12 +573,182 @@ void initial_check(const int *board, int n, int **valid_candidates, int *placed)
         }
         for (cand = 0; cand < N; ++cand) {
             if (check_partial_board(board, n, i, cand + 1))
-                valid_candidates[i][cand] = 1;
+                valid_candidates[i * N + cand] = 1;
+        }
+    }
+    return valid_candidates;
+}
+
+// candidate masks: bit d stands for the number d + 1
+typedef unsigned long long mask_t;
+
+int mask_popcount(mask_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(mask);
+#else
+    int count = 0;
+    for (; mask != 0; mask &= mask - 1)
+        ++count;
+    return count;
+#endif
+}
+
+int mask_lowest(mask_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(mask);
+#else
+    int i = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        ++i;
+    }
+    return i;
+#endif
+}
+
+// Fill the cells forced by naked singles and hidden singles, and apply box/line reductions, until
+// nothing changes. Works on candidate masks (boards up to 64 x 64, bigger ones are left as they are)
+// and writes the result back to board, valid_candidates and placed. Returns the number of filled
+// cells, or -1 when the board turns out to have no solution.
+int propagate(int *board, int n, unsigned char *valid_candidates, int *placed) {
+    int N = n * n, filled = 0, changed = 1;
+    int i, j, k, s, num;
+    if (N > 64)
+        return 0;
+
+    mask_t all_numbers = N == 64 ? ~(mask_t) 0 : ((mask_t) 1 << N) - 1;
+    mask_t *candidates = malloc(N * N * sizeof(mask_t));
+    mask_t *segments = malloc(n * sizeof(mask_t));
+    // the cells of every unit (rows, then columns, then boxes) and the units of every cell
+    int *unit_cells = malloc(3 * N * N * sizeof(int));
+    int *cell_units = malloc(3 * N * N * sizeof(int));
+
+    for (k = 0; k < 3 * N; ++k)
+        for (j = 0; j < N; ++j) {
+            int p = UNIT_CELL(k / N, k % N, j, n);
+            unit_cells[k * N + j] = p;
+            cell_units[p * 3 + k / N] = k;
         }
+    for (i = 0; i < N * N; ++i) {
+        candidates[i] = 0;
+        for (num = 0; num < N; ++num)
+            if (board[i] == 0 && valid_candidates[i * N + num])
+                candidates[i] |= (mask_t) 1 << num;
     }
+
+// put number d + 1 in the empty cell p and drop it from the candidates of the cell's units
+#define PLACE(p, d) { \
+    int place_cell = (p), place_number = (d); \
+    board[place_cell] = place_number + 1; \
+    for (int unit = 0; unit < 3; ++unit) \
+        for (int cell = 0; cell < N; ++cell) \
+            candidates[unit_cells[cell_units[place_cell * 3 + unit] * N + cell]] &= ~((mask_t) 1 << place_number); \
+    candidates[place_cell] = 0; \
+    ++filled; \
+    changed = 1; \
 }
 
-int build_dancing_links(const int *col_ids, const int *row_ids, int n, int **dlx_ptr) {
+    while (changed && filled >= 0) {
+        changed = 0;
+
+        //region Naked singles: a cell with one candidate left
+        for (i = 0; i < N * N && filled >= 0; ++i) {
+            if (board[i] != 0)
+                continue;
+            if (candidates[i] == 0)
+                filled = -1;
+            else if (mask_popcount(candidates[i]) == 1)
+                PLACE(i, mask_lowest(candidates[i]))
+        }
+        //endregion
+
+        // the scans of the units are only worth it once the cheap rule is stuck
+        if (changed)
+            continue;
+
+        //region Hidden singles: a number with one place left in a row, column or box
+        for (k = 0; k < 3 * N && filled >= 0; ++k) {
+            mask_t used = 0, once = 0, twice = 0;
+            for (j = 0; j < N; ++j) {
+                int p = unit_cells[k * N + j];
+                if (board[p] != 0)
+                    used |= (mask_t) 1 << (board[p] - 1);
+                twice |= once & candidates[p];
+                once |= candidates[p];
+            }
+            if (all_numbers & ~(used | once)) {
+                filled = -1;
+            } else if (once & ~twice) {
+                // one placement per unit and pass, the masks of this unit are stale after it
+                num = mask_lowest(once & ~twice);
+                j = 0;
+                while (!(candidates[unit_cells[k * N + j]] >> num & 1))
+                    ++j;
+                PLACE(unit_cells[k * N + j], num)
+            }
+        }
+        //endregion
+
+        if (changed)
+            continue;
+
+        //region Box/line reduction
+        // the places of a number inside a box all lie on one row (column): it cannot go anywhere
+        // else on that row (column); the places on a row (column) all lie in one box: it cannot go
+        // anywhere else in that box. Either way a unit is split into n segments of n cells and the
+        // numbers found in exactly one segment are dropped from the crossing unit outside of it.
+        for (k = 0; k < 4 * N; ++k) {
+            int box_unit = k < 2 * N; // the first 2 * N scans split boxes, the others rows and columns
+            int unit = box_unit ? 2 * N + k / 2 : k - 2 * N;
+            int by_column = box_unit && k % 2;
+            mask_t once = 0, twice = 0;
+
+            for (s = 0; s < n; ++s) {
+                segments[s] = 0;
+                for (j = 0; j < n; ++j)
+                    segments[s] |= candidates[unit_cells[unit * N + (by_column ? j * n + s : s * n + j)]];
+                twice |= once & segments[s];
+                once |= segments[s];
+            }
+
+            for (s = 0; s < n; ++s) {
+                mask_t confined = segments[s] & once & ~twice;
+                if (confined == 0)
+                    continue;
+                // the crossing unit, and the kind of units marking the cells to keep in it
+                int first = unit_cells[unit * N + (by_column ? s : s * n)];
+                int crossing = box_unit ? cell_units[first * 3 + by_column] : cell_units[first * 3 + 2];
+                int keep = box_unit ? 2 : unit / N;
+                for (j = 0; j < N; ++j) {
+                    int p = unit_cells[crossing * N + j];
+                    if (cell_units[p * 3 + keep] != unit && (candidates[p] & confined)) {
+                        candidates[p] &= ~confined;
+                        changed = 1;
+                    }
+                }
+            }
+        }
+        //endregion
+    }
+#undef PLACE
+
+    if (filled >= 0) {
+        *placed += filled;
+        for (i = 0; i < N * N; ++i)
+            for (num = 0; num < N; ++num)
+                valid_candidates[i * N + num] = board[i] == 0 && (candidates[i] >> num & 1);
+    }
+
+    free(candidates);
+    free(segments);
+    free(unit_cells);
+    free(cell_units);
+    return filled;
+}
+
+// Link the n elements of an exact cover matrix into dancing links (DLX_PLANES planes followed by
+// the col/row props) allocated from arena. Returns the number of nodes.
+int build_dancing_links(const int *col_ids, const int *row_ids, int n, int **dlx_ptr, struct Arena *arena) {
 
     // calculate number of nodes
     int num_cols = 0, num_rows = 0, i;
@@ -167,62 +760,62 @@ int build_dancing_links(const int *col_ids, const int *row_ids, int n, int **dlx
     }
     ++num_cols;
     ++num_rows;
-    printf("DLX Grid size: %d x %d\n", num_rows, num_cols);
+    LOG("DLX Grid size: %d x %d\n", num_rows, num_cols);
 
     int count = num_cols + n + 1;// 1 for the head, n for the singular elements, num_cols for the column indicators
 
     // allocate memory for dancing links
-    *dlx_ptr = calloc(count * 6, sizeof(int));
-    int *up, *down, *left, *right, *col, *row;
-    UNLOAD(*dlx_ptr, *dlx_ptr + 4 * count, count)
+    *dlx_ptr = (int *) arena_calloc(arena, (size_t) count * (DLX_PLANES + 2), sizeof(int));
+    int *up, *down, *left, *right, *size, *col, *row;
+    UNLOAD(*dlx_ptr, *dlx_ptr + DLX_PLANES * count, count)
 
     // build column indicators first
     int now_id = 1;
     for (i = 0; i < num_cols; ++i) {
-        left[now_id] = now_id - 1;
-        right[now_id - 1] = now_id;
-        up[now_id] = down[now_id] = col[now_id] = now_id;
+        LEFT(now_id) = now_id - 1;
+        RIGHT(now_id - 1) = now_id;
+        UP(now_id) = DOWN(now_id) = col[now_id] = now_id;
         now_id++;
     }
-    right[now_id - 1] = 0;
-    left[0] = now_id - 1;
+    RIGHT(now_id - 1) = 0;
+    LEFT(0) = now_id - 1;
 
     // save pointers to one element in that row
     // for faster allocation of rows
-    int *row_ptrs = calloc(num_rows, sizeof(int));
+    int *row_ptrs = (int *) arena_calloc(arena, num_rows, sizeof(int));
 
     // insert elements
     for (i = 0; i < n; ++i, ++now_id) {
         // add vertical edges
         int col_ptr_id = col_ids[i] + 1;
         col[now_id] = col_ptr_id;
-        down[now_id] = down[col_ptr_id];
-        down[col_ptr_id] = now_id;
-        up[now_id] = col_ptr_id;
-        up[down[now_id]] = now_id;
+        DOWN(now_id) = DOWN(col_ptr_id);
+        DOWN(col_ptr_id) = now_id;
+        UP(now_id) = col_ptr_id;
+        UP(DOWN(now_id)) = now_id;
+        ++size[col_ptr_id];
 
         // add horizontal edges
         int row_num = row[now_id] = row_ids[i];
         if (row_ptrs[row_num] == 0) {
             // first element in this row
-            left[now_id] = right[now_id] = now_id;
+            LEFT(now_id) = RIGHT(now_id) = now_id;
             row_ptrs[row_num] = now_id;
         } else {
             int row_ptr_id = row_ptrs[row_num];
-            right[now_id] = right[row_ptr_id];
-            right[row_ptr_id] = now_id;
-            left[now_id] = row_ptr_id;
-            left[right[now_id]] = now_id;
+            RIGHT(now_id) = RIGHT(row_ptr_id);
+            RIGHT(row_ptr_id) = now_id;
+            LEFT(now_id) = row_ptr_id;
+            LEFT(RIGHT(now_id)) = now_id;
         }
     }
 
-    free(row_ptrs);
     return count;
 }
 
-// convert a Sudoku matrix to exact cover matrix
-int convert_matrix(const int *board, int **valid_candidates, int placed, int n, int **cols_ptr, int **rows_ptr,
-                   int **convert_table_ptr) {
+// convert a Sudoku matrix to exact cover matrix, allocated from arena
+int convert_matrix(const int *board, const unsigned char *valid_candidates, int placed, int n, int **cols_ptr,
+                   int **rows_ptr, int **convert_table_ptr, struct Arena *arena) {
     //https://www.jianshu.com/p/93b52c37cc65
     int N = n * n, i, j;
     int total = N * N;
@@ -231,15 +824,15 @@ int convert_matrix(const int *board, int **valid_candidates, int placed, int n,
 
     for (i = 0; i < N * N; ++i) {
         for (j = 0; j < N; ++j) {
-            if (valid_candidates[i][j]) {
+            if (valid_candidates[i * N + j]) {
                 ++elements_count;
             }
         }
     }
 
-    *cols_ptr = (int *) malloc(sizeof(int) * elements_count * 4);
-    *rows_ptr = (int *) malloc(sizeof(int) * elements_count * 4);
-    *convert_table_ptr = (int *) malloc(sizeof(int) * elements_count);
+    *cols_ptr = (int *) arena_alloc(arena, sizeof(int) * elements_count * 4);
+    *rows_ptr = (int *) arena_alloc(arena, sizeof(int) * elements_count * 4);
+    *convert_table_ptr = (int *) arena_alloc(arena, sizeof(int) * elements_count);
     int *cols = *cols_ptr;
     int *rows = *rows_ptr;
     int *convert_table = *convert_table_ptr;
@@ -263,7 +856,7 @@ int convert_matrix(const int *board, int **valid_candidates, int placed, int n,
     for (i = 0; i < N * N; ++i) {
         if (board[i] == 0) {
             for (j = 0; j < N; ++j) {
-                if (valid_candidates[i][j]) {
+                if (valid_candidates[i * N + j]) {
                     insert_number_into_matrix(j + 1);
                     convert_table[row_num] = (i * N) + j;
                     row_num++;
@@ -281,74 +874,267 @@ int convert_matrix(const int *board, int **valid_candidates, int placed, int n,
     return elem;
 }
 
-// convert an exact cover answer to a Sudoku answer and print
-void convert_answer_print(int task_row, const int *ans, const int *convert_table, int N) {
-    int i;
-    int *answer_board = calloc(N * N, sizeof(int));
-    int pos_and_num = convert_table[task_row];
-    answer_board[pos_and_num / N] = pos_and_num % N + 1;
-//    printf("task row: %d, convert table: %d, pos: %d, num: %d\n",
-//           task_row, convert_table[task_row], pos_and_num / N, pos_and_num % N + 1
-//    );
-    for (i = 0; i < N * N - 1; ++i) {
+// Build the dancing links of a board straight from its valid_candidates, without the exact cover
+// matrix of convert_matrix: the rows of the given cells and the columns they satisfy are left out
+// instead of being covered by the search, so an answer only holds the rows of the empty cells and
+// has to be written over the board. The columns and the links of every row are in the order
+// convert_matrix and build_dancing_links give them, so the search takes the same path.
+// Allocates the dancing links and the convert table (number of every row) from arena, returns the
+// number of nodes.
+int build_board_links(const int *board, const unsigned char *valid_candidates, int n, int **dlx_ptr,
+                      int **convert_table_ptr, struct Arena *arena) {
+    int N = n * n, total = N * N, i, j, k;
+
+    // column of every constraint (cell, then number in row, column and box), 0 once satisfied
+    int *constraint_cols = (int *) arena_alloc(arena, sizeof(int) * 4 * total);
+    for (i = 0; i < 4 * total; ++i)
+        constraint_cols[i] = 1;
+    int num_rows = 0;
+    for (i = 0; i < total; ++i) {
+        if (board[i] != 0) {
+            int num = board[i] - 1;
+            constraint_cols[i] = 0;
+            constraint_cols[total + ROW(i, N) * N + num] = 0;
+            constraint_cols[total * 2 + COL(i, N) * N + num] = 0;
+            constraint_cols[total * 3 + BOX(i, n) * N + num] = 0;
+            continue;
+        }
+        for (j = 0; j < N; ++j)
+            num_rows += valid_candidates[i * N + j];
+    }
+    int num_cols = 0;
+    for (i = 0; i < 4 * total; ++i)
+        if (constraint_cols[i])
+            constraint_cols[i] = ++num_cols;
+    LOG("DLX Grid size: %d x %d\n", num_rows, num_cols);
+
+    int count = 1 + num_cols + 4 * num_rows; // the head, the column indicators, then 4 nodes per row
+
+    *dlx_ptr = (int *) arena_calloc(arena, (size_t) count * (DLX_PLANES + 2), sizeof(int));
+    *convert_table_ptr = (int *) arena_alloc(arena, sizeof(int) * (num_rows > 0 ? num_rows : 1));
+    int *convert_table = *convert_table_ptr;
+    int *up, *down, *left, *right, *size, *col, *row;
+    UNLOAD(*dlx_ptr, *dlx_ptr + DLX_PLANES * count, count)
+
+    for (i = 0; i <= num_cols; ++i) {
+        LEFT(i) = i - 1;
+        RIGHT(i) = i + 1;
+        UP(i) = DOWN(i) = col[i] = i;
+    }
+    LEFT(0) = num_cols;
+    RIGHT(num_cols) = 0;
+
+    int now_id = num_cols + 1, row_num = 0;
+    for (i = 0; i < total; ++i) {
+        if (board[i] != 0)
+            continue;
+        for (j = 0; j < N; ++j) {
+            if (!valid_candidates[i * N + j])
+                continue;
+            int cols[4] = {constraint_cols[i], constraint_cols[total + ROW(i, N) * N + j],
+                           constraint_cols[total * 2 + COL(i, N) * N + j],
+                           constraint_cols[total * 3 + BOX(i, n) * N + j]};
+
+            for (k = 0; k < 4; ++k) {
+                // each node goes on top of its column
+                int id = now_id + k, col_id = cols[k];
+                col[id] = col_id;
+                row[id] = row_num;
+                UP(id) = col_id;
+                DOWN(id) = DOWN(col_id);
+                UP(DOWN(col_id)) = id;
+                DOWN(col_id) = id;
+                ++size[col_id];
+            }
+            // the cell node, then the box, column and row ones
+            RIGHT(now_id) = now_id + 3;
+            RIGHT(now_id + 3) = now_id + 2;
+            RIGHT(now_id + 2) = now_id + 1;
+            RIGHT(now_id + 1) = now_id;
+            for (k = 0; k < 4; ++k)
+                LEFT(RIGHT(now_id + k)) = now_id + k;
+
+            convert_table[row_num++] = i * N + j;
+            now_id += 4;
+        }
+    }
+
+    return count;
+}
+
+// write the numbers chosen by the exact cover rows in ans into board
+void convert_answer_board(const int *ans, int length, const int *convert_table, int N, int *board) {
+    int i, pos_and_num;
+    for (i = 0; i < length; ++i) {
         pos_and_num = convert_table[ans[i]];
-        answer_board[pos_and_num / N] = pos_and_num % N + 1;
+        board[pos_and_num / N] = pos_and_num % N + 1;
     }
+}
+
+// convert an exact cover answer below a task prefix (prefix_length rows, -1 ends it sooner)
+// to a Sudoku answer and print
+void convert_answer_print(const int *prefix, int prefix_length, const int *ans, int length,
+                          const int *convert_table, int N) {
+    int *answer_board = calloc(N * N, sizeof(int));
+    int task_length = 0;
+    while (task_length < prefix_length && prefix[task_length] >= 0)
+        ++task_length;
+    convert_answer_board(prefix, task_length, convert_table, N, answer_board);
+    convert_answer_board(ans, length, convert_table, N, answer_board);
     print_board(answer_board, N);
     free(answer_board);
 }
 
-void convert_answer_print_serial(const int *ans, const int *convert_table, int N) {
-    int i;
-    int *answer_board = calloc(N * N, sizeof(int));
-    int pos_and_num;
-    for (i = 0; i < N * N; ++i) {
-        pos_and_num = convert_table[ans[i]];
-        answer_board[pos_and_num / N] = pos_and_num % N + 1;
-    }
+// print board with the length rows of an exact cover answer written over it
+void convert_answer_print_serial(const int *board, const int *ans, int length, const int *convert_table, int N) {
+    int *answer_board = malloc(N * N * sizeof(int));
+    memcpy(answer_board, board, N * N * sizeof(int));
+    convert_answer_board(ans, length, convert_table, N, answer_board);
     print_board(answer_board, N);
     free(answer_board);
 }
 
-void remove_column(int id, int *dlx, int dlx_size) {
-    int *up, *down, *left, *right;
+void remove_column(int id, int *dlx, const int *col, int dlx_size) {
+    int *up, *down, *left, *right, *size;
     UNLOAD_NO_PROPS(dlx, dlx_size);
 
     // first detach the column indicator
-    right[left[id]] = right[id];
-    left[right[id]] = left[id];
+    RIGHT(LEFT(id)) = RIGHT(id);
+    LEFT(RIGHT(id)) = LEFT(id);
 
     // find every row of this column
     int row_id, elem;
-    for (row_id = down[id]; row_id != id; row_id = down[row_id]) {
+    for (row_id = DOWN(id); row_id != id; row_id = DOWN(row_id)) {
         // find every element in that row
-        for (elem = right[row_id]; elem != row_id; elem = right[elem]) {
+        for (elem = RIGHT(row_id); elem != row_id; elem = RIGHT(elem)) {
             // detach that element
-            down[up[elem]] = down[elem];
-            up[down[elem]] = up[elem];
+            DOWN(UP(elem)) = DOWN(elem);
+            UP(DOWN(elem)) = UP(elem);
+            --size[col[elem]];
         }
     }
 }
 
-void restore_column(int id, int *dlx, int dlx_size) {
-    int *up, *down, *left, *right;
+void restore_column(int id, int *dlx, const int *col, int dlx_size) {
+    int *up, *down, *left, *right, *size;
     UNLOAD_NO_PROPS(dlx, dlx_size);
 
     // first detach the column indicator
-    right[left[id]] = id;
-    left[right[id]] = id;
+    RIGHT(LEFT(id)) = id;
+    LEFT(RIGHT(id)) = id;
 
-    // find every row of this column
-    for (int c_row = down[id]; c_row != id; c_row = down[c_row]) {
+    // find every row of this column, in the reverse order of remove_column
+    for (int c_row = UP(id); c_row != id; c_row = UP(c_row)) {
         // find every element in that row
-        for (int elem = right[c_row]; elem != c_row; elem = right[elem]) {
+        for (int elem = LEFT(c_row); elem != c_row; elem = LEFT(elem)) {
             // attach that element
-            down[up[elem]] = elem;
-            up[down[elem]] = elem;
+            DOWN(UP(elem)) = elem;
+            UP(DOWN(elem)) = elem;
+            ++size[col[elem]];
         }
     }
 }
 
+// choose the uncovered column with the fewest rows (Knuth's S heuristic)
+int choose_column(const int *dlx, int dlx_size) {
+    const int *right = LINK_PLANE(dlx, 3, dlx_size);
+    const int *size = dlx + dlx_size * 4;
+
+    int best = RIGHT(0);
+    for (int c_col = RIGHT(best); c_col != 0 && size[best] > 1; c_col = RIGHT(c_col)) {
+        if (size[c_col] < size[best])
+            best = c_col;
+    }
+    return best;
+}
+
+//region Template
+// --template: the dancing links of an empty N x N board (every candidate of every cell, N^3 rows) are
+// built once with convert_matrix and build_dancing_links, and every puzzle of that size starts from
+// a copy of them with the rows of its clues covered, as a search would. There is no initial_check,
+// propagation or build per puzzle, at the price of links three to four times bigger than those of
+// build_board_links (the rows excluded by the clues are only unlinked).
+struct DlxTemplate {
+    int N;              // 0 before the first board
+    int dlx_size;
+    int *dlx;           // DLX_PLANES planes followed by the col/row props
+    struct Arena arena; // holds the above, until a board of another size comes in
+    // number of every row: row i * N + d is candidate d + 1 of cell i, so the table is the identity
+    // and serves every size up to the biggest seen. The puzzles read it in place, so it outlives the
+    // links: a bigger board allocates a new one, and the old ones stay in tables until free_template.
+    int *convert_table;
+    size_t convert_rows;
+    struct Arena tables;
+};
+
+// make t the template of n x n boxes boards, unless it already is
+void load_template(struct DlxTemplate *t, int n) {
+    int N = n * n, *col_ids, *row_ids, *convert_table;
+    if (t->N == N)
+        return;
+
+    arena_reset(&t->arena);
+    int *empty = (int *) arena_calloc(&t->arena, N * N, sizeof(int));
+    unsigned char *candidates = (unsigned char *) arena_alloc(&t->arena, (size_t) N * N * N);
+    memset(candidates, 1, (size_t) N * N * N);
+
+    int num_elems = convert_matrix(empty, candidates, 0, n, &col_ids, &row_ids, &convert_table, &t->arena);
+    t->dlx_size = build_dancing_links(col_ids, row_ids, num_elems, &t->dlx, &t->arena);
+    t->N = N;
+
+    size_t rows = (size_t) N * N * N;
+    if (rows > t->convert_rows) {
+        t->convert_table = (int *) arena_alloc(&t->tables, rows * sizeof(int));
+        memcpy(t->convert_table, convert_table, rows * sizeof(int));
+        t->convert_rows = rows;
+    }
+}
+
+void free_template(struct DlxTemplate *t) {
+    arena_free(&t->arena);
+    arena_free(&t->tables);
+}
+
+// Copy the template into arena, then cover the rows of the clues of board. The convert table is the
+// one of the template, read in place.
+// Returns the number of clues, or -1 when two of them are in the same row, column or box
+// (or a clue is out of range): the board has no solution.
+int apply_template(const struct DlxTemplate *t, const int *board, int **dlx_ptr, int **convert_table_ptr,
+                   struct Arena *arena) {
+    int N = t->N, dlx_size = t->dlx_size, num_cols = 4 * N * N, clues = 0;
+    size_t ints = (size_t) dlx_size * (DLX_PLANES + 2);
+
+    int *dlx = *dlx_ptr = (int *) arena_alloc(arena, ints * sizeof(int));
+    memcpy(dlx, t->dlx, ints * sizeof(int));
+    *convert_table_ptr = t->convert_table;
+
+    const int *left = LINK_PLANE(dlx, 2, dlx_size);
+    const int *right = LINK_PLANE(dlx, 3, dlx_size);
+    const int *col = dlx + DLX_PLANES * dlx_size;
+
+    for (int i = 0; i < N * N; ++i) {
+        if (board[i] == 0)
+            continue;
+        if (board[i] < 0 || board[i] > N)
+            return -1;
+        // the 4 nodes of row i * N + d follow the column indicators in that order
+        int first = 1 + num_cols + 4 * (i * N + board[i] - 1), elem = first;
+        do {
+            // a column covered by an earlier clue is out of the header list
+            if (RIGHT(LEFT(col[elem])) != col[elem])
+                return -1;
+            elem = RIGHT(elem);
+        } while (elem != first);
+        do {
+            remove_column(col[elem], dlx, col, dlx_size);
+            elem = RIGHT(elem);
+        } while (elem != first);
+        ++clues;
+    }
+    return clues;
+}
+//endregion
+
 struct Info {
     cl_platform_id platform;
     cl_device_id device;
@@ -360,34 +1146,186 @@ struct Info {
 };
 
 void freeInfo(struct Info info) {
-    clReleaseKernel(info.kernel);
-    clReleaseProgram(info.program);
+    if (info.kernel != NULL)
+        clReleaseKernel(info.kernel);
+    if (info.program != NULL)
+        clReleaseProgram(info.program);
     clReleaseCommandQueue(info.queue);
     clReleaseContext(info.context);
 }
 
-struct Info initialize(const char *kernels_file, const char *kernel_name) {
+//region Program cache
+// Programs built from source are saved with clGetProgramInfo(CL_PROGRAM_BINARIES) in the directory
+// named by DLX_CACHE_DIR (.dlx_cache by default, an empty value disables the cache), and later runs
+// load them with clCreateProgramWithBinary. A binary is keyed by a hash of the device, its driver,
+// the build options and the kernel source, so editing the kernels or updating the driver rebuilds.
+
+const char *program_cache_dir() {
+    const char *dir = getenv("DLX_CACHE_DIR");
+    return dir != NULL ? dir : ".dlx_cache";
+}
+
+// 64-bit FNV-1a of length bytes, going on from hash
+unsigned long long fnv1a(unsigned long long hash, const void *data, size_t length) {
+    const unsigned char *bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Path of the cached binary of kernels_file for dev, built with build_options.
+// Returns 0 when the cache is disabled or the source cannot be read.
+int program_cache_path(const char *kernels_file, cl_device_id dev, const char *build_options,
+                       char *path, size_t path_size) {
+    const char *dir = program_cache_dir();
+    if (*dir == 0)
+        return 0;
+
+    FILE *fp = fopen(kernels_file, "rb");
+    if (fp == NULL)
+        return 0;
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    char buffer[4096];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        hash = fnv1a(hash, buffer, read);
+    fclose(fp);
+
+    cl_device_info keys[] = {CL_DEVICE_NAME, CL_DEVICE_VERSION, CL_DRIVER_VERSION};
+    for (int i = 0; i < 3; ++i) {
+        size_t length = 0;
+        if (clGetDeviceInfo(dev, keys[i], sizeof(buffer), buffer, &length) != CL_SUCCESS)
+            return 0;
+        hash = fnv1a(hash, buffer, length < sizeof(buffer) ? length : sizeof(buffer));
+    }
+    hash = fnv1a(hash, build_options, strlen(build_options) + 1);
+
+    const char *name = strrchr(kernels_file, '/');
+    name = name != NULL ? name + 1 : kernels_file;
+    snprintf(path, path_size, "%s/%s-%016llx.bin", dir, name, hash);
+    return 1;
+}
+
+// program built from the binary at path, NULL when there is none or the driver rejects it
+cl_program load_cached_program(const char *path, cl_context ctx, cl_device_id dev, const char *build_options) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+    fseek(fp, 0, SEEK_END);
+    long length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (length <= 0) {
+        fclose(fp);
+        return NULL;
+    }
+    unsigned char *binary = (unsigned char *) malloc(length);
+    size_t size = fread(binary, 1, length, fp);
+    fclose(fp);
+
+    cl_int err, status;
+    const unsigned char *binaries[] = {binary};
+    cl_program prg = clCreateProgramWithBinary(ctx, 1, &dev, &size, binaries, &status, &err);
+    free(binary);
+    if (err != CL_SUCCESS || status != CL_SUCCESS) {
+        if (prg != NULL)
+            clReleaseProgram(prg);
+        return NULL;
+    }
+    if (clBuildProgram(prg, 1, &dev, build_options, NULL, NULL) != CL_SUCCESS) {
+        clReleaseProgram(prg);
+        return NULL;
+    }
+    return prg;
+}
+
+// write the binary of a program built for a single device to path, failing silently
+void save_cached_program(const char *path, cl_program prg) {
+    size_t size = 0;
+    if (clGetProgramInfo(prg, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS || size == 0)
+        return;
+    unsigned char *binary = (unsigned char *) malloc(size);
+    unsigned char *binaries[] = {binary};
+    if (clGetProgramInfo(prg, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL) != CL_SUCCESS) {
+        free(binary);
+        return;
+    }
+
+#ifdef _WIN32
+    _mkdir(program_cache_dir());
+#else
+    mkdir(program_cache_dir(), 0755);
+#endif
+    // written aside and renamed, so that a concurrent run never loads half a binary
+    char temp_path[1100];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    FILE *fp = fopen(temp_path, "wb");
+    if (fp != NULL) {
+        int written = fwrite(binary, 1, size, fp) == size;
+        fclose(fp);
+        if (!written || rename(temp_path, path) != 0)
+            remove(temp_path);
+    }
+    free(binary);
+}
+
+// create_program_with_options through the cache
+cl_program create_cached_program(const char *kernels_file, cl_context ctx, cl_device_id dev,
+                                 const char *build_options) {
+    char path[1024];
+    int cached = program_cache_path(kernels_file, dev, build_options, path, sizeof(path));
+
+    if (cached) {
+        cl_program prg = load_cached_program(path, ctx, dev, build_options);
+        if (prg != NULL) {
+            LOG("Program loaded from %s\n", path);
+            return prg;
+        }
+    }
+
+    cl_program prg = create_program_with_options(kernels_file, ctx, dev, build_options);
+    // only a program that built is worth loading again
+    cl_build_status status = CL_BUILD_ERROR;
+    clGetProgramBuildInfo(prg, dev, CL_PROGRAM_BUILD_STATUS, sizeof(status), &status, NULL);
+    if (cached && status == CL_BUILD_SUCCESS)
+        save_cached_program(path, prg);
+    return prg;
+}
+//endregion
+
+// (Re)build the program of info from kernels_file and extract kernel_name from it.
+// build_options are handed to the OpenCL compiler, "-I." unless a build needs defines.
+void load_kernel(struct Info *info, const char *kernels_file, const char *kernel_name, const char *build_options) {
     cl_int err;
-    //region Initialize OpenCL
-    cl_platform_id p = select_platform();
-    cl_device_id d = select_device(p);
-    cl_context ctx = create_context(p, d);
-    cl_command_queue que = create_queue(ctx, d);
-    //endregion
+    if (info->kernel != NULL)
+        clReleaseKernel(info->kernel);
+    if (info->program != NULL)
+        clReleaseProgram(info->program);
 
-    //region Initialize Kernel
-    cl_program prog = create_program(kernels_file, ctx, d);
+    info->program = create_cached_program(kernels_file, info->context, info->device, build_options);
 
-    cl_kernel calculate_cost_k = clCreateKernel(prog, kernel_name, &err);
+    info->kernel = clCreateKernel(info->program, kernel_name, &err);
     ocl_check(err, "create kernel");
 
+    clGetKernelWorkGroupInfo(info->kernel, info->device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                             sizeof(info->preferred_multiple_init), &info->preferred_multiple_init, NULL);
+}
 
-    size_t preferred_multiple_init;
-    clGetKernelWorkGroupInfo(calculate_cost_k, d, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
-                             sizeof(preferred_multiple_init), &preferred_multiple_init, NULL);
+// Set up the platform, device, context and queue, and load kernel_name from kernels_file
+// unless it is NULL (see load_kernel)
+struct Info initialize(const char *kernels_file, const char *kernel_name, const char *build_options) {
+    //region Initialize OpenCL
+    cl_platform_id p = select_platform();
+    cl_device_id d = select_device(p);
+    cl_context ctx = create_context(p, d);
+    cl_command_queue que = create_queue(ctx, d);
     //endregion
 
-    return (struct Info) {p, d, ctx, que, prog, calculate_cost_k, preferred_multiple_init};
+    struct Info info = {p, d, ctx, que, NULL, NULL, 0};
+    if (kernels_file != NULL)
+        load_kernel(&info, kernels_file, kernel_name, build_options);
+    return info;
 }
 
 void AddKernelArg(cl_kernel kernel, cl_uint arg_index, size_t arg_size, void *arg_value) {
@@ -414,6 +1352,8 @@ struct MemoryString memory_string(size_t bytes) {
 
 struct Task {
     int completed;
+    int found;
+    int skipped; // too big for the device: never searched, and not known to have no solution
     int size;
     int lws;
     int tasks;
@@ -431,10 +1371,12 @@ struct Task {
     cl_ulong read_answer_found_nanoseconds;
     size_t read_answer_byte;
     cl_ulong read_answer_nanoseconds;
+    unsigned int solutions; // found before the search stopped, see solution_limit
+    double load_imbalance; // persistent kernels only, not part of the csv
 };
 
 void write_task_to_csv(FILE *csv, struct Task task) {
-    fprintf(csv, "%s;%d;%d;%d;%zu;%llu;%zu;%llu;%zu;%llu;%zu;%llu;%zu;%llu;%zu;%llu;%zu;%llu\n",
+    fprintf(csv, "%s;%d;%d;%d;%zu;%llu;%zu;%llu;%zu;%llu;%zu;%llu;%zu;%llu;%zu;%llu;%zu;%llu;%u\n",
             task.completed ? "TRUE" : "FALSE",
             task.size,
             task.lws,
@@ -452,6 +1394,7 @@ void write_task_to_csv(FILE *csv, struct Task task) {
             task.read_answer_found_byte,
             task.read_answer_found_nanoseconds,
             task.read_answer_byte,
-            task.read_answer_nanoseconds
+            task.read_answer_nanoseconds,
+            task.solutions
     );
 }
\ No newline at end of file
@@ -0,0 +1,113 @@
+// generate one task for each row of each column of the dancing links
+int permutate_tasks(const int *dlx, int dlx_size, int *tasks, int tasks_size) {
+    const int *down = LINK_PLANE(dlx, 1, dlx_size);
+    const int *right = LINK_PLANE(dlx, 3, dlx_size);
+
+    int count = 0;
+
+    // iterate each column
+    int c_col;
+    for (c_col = RIGHT(0); c_col != 0; c_col = RIGHT(c_col)) {
+        // iterate each row
+        int c_row;
+        for (c_row = DOWN(c_col); c_row != c_col; c_row = DOWN(c_row)) {
+            if (count > tasks_size) {
+                fprintf(stderr, "slots not enough: tried to generate %d-th task but only %d slots available.\n",
+                        ++count, tasks_size);
+                continue;
+            }
+
+            tasks[count++] = c_row;
+        }
+    }
+    return count;
+}
+
+// cover the columns of the row containing c_row, as the search does when it pushes c_row
+void cover_row(int c_row, int *dlx, const int *col, int dlx_size) {
+    const int *right = LINK_PLANE(dlx, 3, dlx_size);
+
+    remove_column(col[c_row], dlx, col, dlx_size);
+    for (int elem = RIGHT(c_row); elem != c_row; elem = RIGHT(elem))
+        remove_column(col[elem], dlx, col, dlx_size);
+}
+
+// undo cover_row, in the reverse order
+void uncover_row(int c_row, int *dlx, const int *col, int dlx_size) {
+    const int *left = LINK_PLANE(dlx, 2, dlx_size);
+
+    for (int elem = LEFT(c_row); elem != c_row; elem = LEFT(elem))
+        restore_column(col[elem], dlx, col, dlx_size);
+    restore_column(col[c_row], dlx, col, dlx_size);
+}
+
+// Expand the search tree breadth-first, branching every level on the column with the fewest rows
+// like the search does, until there are at least target_count tasks or max_depth levels branched
+// (levels where every column had a single row do not count). Unlike permutate_tasks the tasks are disjoint subtrees that together cover the whole search.
+// Every task is a prefix of *depth_ptr rows (node ids), padded with -1 when it covers every column
+// sooner. Returns the number of tasks, stored in a new array at *tasks_ptr (0 when there is no solution).
+int expand_tasks(const int *dlx, int dlx_size, int max_depth, int target_count, int **tasks_ptr, int *depth_ptr) {
+    const int *col = dlx + DLX_PLANES * dlx_size;
+    int *work = (int *) malloc(dlx_size * DLX_PLANES * sizeof(int));
+    memcpy(work, dlx, dlx_size * DLX_PLANES * sizeof(int));
+    const int *down = LINK_PLANE(work, 1, dlx_size);
+    const int *right = LINK_PLANE(work, 3, dlx_size);
+
+    // the root: one empty prefix
+    int *tasks = (int *) malloc(sizeof(int));
+    int count = 1, depth = 0, branched = 0, expanded = 1;
+
+    // at least one level, so that every task has a row to cover
+    while (expanded && count > 0 && (depth == 0 || (count < target_count && branched < max_depth))) {
+        int capacity = count * 2, next_count = 0;
+        int *next = (int *) malloc(capacity * (depth + 1) * sizeof(int));
+        int branching = 0;
+        expanded = 0;
+
+        for (int t = 0; t < count; ++t) {
+            const int *prefix = tasks + t * depth;
+            int length = 0;
+            while (length < depth && prefix[length] >= 0)
+                cover_row(prefix[length++], work, col, dlx_size);
+
+            // a complete prefix is kept as it is, a column without rows drops the task
+            int c_col = RIGHT(0) == 0 ? 0 : choose_column(work, dlx_size);
+            int c_row = c_col == 0 ? -1 : DOWN(c_col);
+            while (c_row != c_col) {
+                if (next_count == capacity) {
+                    capacity *= 2;
+                    next = (int *) realloc(next, capacity * (depth + 1) * sizeof(int));
+                }
+                int *child = next + next_count++ * (depth + 1);
+                memcpy(child, prefix, depth * sizeof(int));
+                child[depth] = c_row;
+
+                if (c_col == 0)
+                    break;
+                expanded = 1;
+                c_row = DOWN(c_row);
+                if (c_row != c_col)
+                    branching = 1;
+            }
+
+            while (length > 0)
+                uncover_row(prefix[--length], work, col, dlx_size);
+        }
+
+        if (!expanded) {
+            // every prefix covered every column, the level would only pad them
+            free(next);
+            break;
+        }
+        free(tasks);
+        tasks = next;
+        count = next_count;
+        ++depth;
+        branched += branching;
+    }
+
+    free(work);
+    *tasks_ptr = tasks;
+    *depth_ptr = depth;
+    return count;
+}